@@ -0,0 +1,38 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace flexBPE {
+namespace bench {
+
+// a text of nWords words drawn from nTypes word types with Zipfian
+// frequencies, as in natural text. the types are random lowercase strings
+// of 2 to 14 letters, lines have 20 words.
+inline std::string zipf_corpus(size_t nWords, size_t nTypes,
+                               unsigned seed = 7) {
+  std::mt19937_64 rng(seed);
+  std::vector<std::string> types(nTypes);
+  for (auto &t : types) {
+    size_t len = 2 + rng() % 13;
+    for (size_t i = 0; i < len; i++)
+      t.push_back('a' + rng() % 26);
+  }
+  std::vector<double> cdf(nTypes);
+  double sum = 0;
+  for (size_t i = 0; i < nTypes; i++)
+    cdf[i] = sum += 1.0 / double(i + 1);
+  std::uniform_real_distribution<double> u(0, sum);
+  std::string text;
+  for (size_t i = 0; i < nWords; i++) {
+    size_t t = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+    text += types[std::min(t, nTypes - 1)];
+    text.push_back(i % 20 == 19 ? '\n' : ' ');
+  }
+  return text;
+}
+
+} // namespace bench
+} // namespace flexBPE
@@ -0,0 +1,149 @@
+#include "bench/benchUtil.h"
+#include "flexBPE/flexBPE.h"
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <sstream>
+
+using namespace flexBPE;
+
+// end to end benchmarks on synthetic Zipfian corpora. the corpora and the
+// codes they use are made once per process and are the same in every run,
+// so results of two commits can be compared, e.g. with
+//   flexbpe-bench --benchmark_out=result.json --benchmark_out_format=json
+// most of them run on several threads and are timed in wall time.
+
+namespace {
+struct bench_corpus {
+  string text;
+  string path;
+  vector<string> lines;
+  size_t words = 0;
+};
+
+// corpus i has 10^(i + 4) words, from 10^(i + 3) types
+const bench_corpus &corpus(int64_t i) {
+  static bench_corpus corpora[3];
+  auto &c = corpora[i];
+  if (c.path.empty()) {
+    size_t words = 1;
+    for (int64_t k = 0; k < i + 4; k++)
+      words *= 10;
+    c.text = bench::zipf_corpus(words, words / 10);
+    c.words = words;
+    c.path = "flexbpe-bench-corpus-" + to_string(i) + ".txt";
+    FILE *f = fopen(c.path.c_str(), "wb");
+    fwrite(c.text.data(), 1, c.text.size(), f);
+    fclose(f);
+    istringstream in(c.text);
+    for (string line; getline(in, line);)
+      c.lines.push_back(line);
+  }
+  return c;
+}
+
+// codes learned once on the middle corpus
+BPETrainer &trained() {
+  static BPETrainer *trainer = [] {
+    auto *t = new BPETrainer();
+    t->learncodes(5000, corpus(1).path.c_str(), "", false, false);
+    return t;
+  }();
+  return *trainer;
+}
+
+void set_rates(benchmark::State &state, const bench_corpus &c) {
+  state.SetBytesProcessed(int64_t(state.iterations()) * c.text.size());
+  state.counters["words/s"] = benchmark::Counter(
+      double(c.words), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+struct cleanup {
+  ~cleanup() {
+    for (int i = 0; i < 3; i++)
+      remove(("flexbpe-bench-corpus-" + to_string(i) + ".txt").c_str());
+    remove("flexbpe-bench-output.txt");
+  }
+} cleanupAtExit;
+} // namespace
+
+static void BM_getvocab(benchmark::State &state) {
+  auto &c = corpus(state.range(0));
+  for (auto _ : state) {
+    BPETrainer trainer;
+    trainer.getvocab(c.path.c_str(), "", false);
+    benchmark::DoNotOptimize(trainer.vocab.size());
+  }
+  set_rates(state, c);
+}
+BENCHMARK(BM_getvocab)
+    ->ArgName("corpus")
+    ->DenseRange(0, 2)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_learncodes(benchmark::State &state) {
+  auto &c = corpus(2);
+  size_t nCodes = 0;
+  for (auto _ : state) {
+    BPETrainer trainer;
+    trainer.learncodes(state.range(0), c.path.c_str(), "", false, false);
+    nCodes = trainer.codes.size();
+  }
+  state.counters["codes/s"] = benchmark::Counter(
+      double(nCodes), benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_learncodes)
+    ->ArgName("codes")
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(10000)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// one sentence at a time, as a server would
+static void BM_apply(benchmark::State &state) {
+  auto &c = corpus(1);
+  auto &trainer = trained();
+  trainer.set_cache_capacity(state.range(0));
+  vector<string> lines = c.lines;
+  for (auto _ : state) {
+    for (auto &line : lines)
+      benchmark::DoNotOptimize(trainer.apply(line));
+  }
+  trainer.set_cache_capacity(0);
+  set_rates(state, c);
+}
+BENCHMARK(BM_apply)
+    ->ArgName("cache")
+    ->Arg(0)
+    ->Arg(1 << 16)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_applybpe(benchmark::State &state) {
+  auto &c = corpus(state.range(0));
+  auto &trainer = trained();
+  for (auto _ : state)
+    trainer.applybpe("flexbpe-bench-output.txt", c.path.c_str());
+  set_rates(state, c);
+}
+BENCHMARK(BM_applybpe)
+    ->ArgName("corpus")
+    ->DenseRange(0, 2)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_applybpe_stream(benchmark::State &state) {
+  auto &c = corpus(1);
+  auto &trainer = trained();
+  trainer.set_cache_capacity(1 << 16);
+  for (auto _ : state) {
+    istringstream in(c.text);
+    ostringstream out;
+    trainer.applybpe_stream(in, out);
+    benchmark::DoNotOptimize(out.tellp());
+  }
+  trainer.set_cache_capacity(0);
+  set_rates(state, c);
+}
+BENCHMARK(BM_applybpe_stream)->UseRealTime()->Unit(benchmark::kMillisecond);
@@ -0,0 +1,92 @@
+#include "bench/benchUtil.h"
+#include "flexBPE/flexBPE.h"
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+#include <iterator>
+
+using namespace flexBPE;
+
+// the boost style combine pair_hash used before the flat maps
+struct legacy_pair_hash {
+  size_t operator()(const tp &p) const {
+    size_t seed = hash<uint32_t>{}(p.first);
+    return hash<uint32_t>{}(p.second) + 0x9e3779b9 + (seed << 6) +
+           (seed >> 2);
+  }
+};
+
+static const string &test_corpus() {
+  static string text = [] {
+    ifstream in(FLEXBPE_SOURCE_DIR "/test/assets/corpus.txt");
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  }();
+  return text;
+}
+
+static const string &large_corpus() {
+  static string text = bench::zipf_corpus(2000000, 200000);
+  return text;
+}
+
+static const string &corpus(int which) {
+  return which == 0 ? test_corpus() : large_corpus();
+}
+
+// counts the words of a corpus, keyed on views into it
+template <class Map> static void BM_count_words(benchmark::State &state) {
+  auto &text = corpus(state.range(0));
+  for (auto _ : state) {
+    Map counts;
+    size_t start = 0;
+    for_each_separator(text.data(), text.size(), [&](size_t i) {
+      if (i > start)
+        counts[string_view(text.data() + start, i - start)]++;
+      start = i + 1;
+    });
+    benchmark::DoNotOptimize(counts.size());
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+}
+BENCHMARK_TEMPLATE(BM_count_words, unordered_map<string_view, uint32_t>)
+    ->ArgName("large")
+    ->Arg(0)
+    ->Arg(1);
+BENCHMARK_TEMPLATE(BM_count_words, flat_map<string_view, uint32_t>)
+    ->ArgName("large")
+    ->Arg(0)
+    ->Arg(1);
+
+// counts the pairs of adjacent characters of every word, like the first
+// pass of learncodes
+template <class Map> static void BM_count_pairs(benchmark::State &state) {
+  auto &text = corpus(state.range(0));
+  vector<tp> pairs;
+  size_t start = 0;
+  for_each_separator(text.data(), text.size(), [&](size_t i) {
+    for (size_t j = start + 1; j < i; j++) {
+      uint32_t right = uint8_t(text[j]) + 256 * (j - start);
+      pairs.emplace_back(uint8_t(text[j - 1]), right);
+    }
+    start = i + 1;
+  });
+  for (auto _ : state) {
+    Map counts;
+    for (auto &p : pairs)
+      counts[p]++;
+    benchmark::DoNotOptimize(counts.size());
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * pairs.size());
+}
+BENCHMARK_TEMPLATE(BM_count_pairs, unordered_map<tp, int32_t, legacy_pair_hash>)
+    ->ArgName("large")
+    ->Arg(0)
+    ->Arg(1);
+BENCHMARK_TEMPLATE(BM_count_pairs, unordered_map<tp, int32_t, pair_hash>)
+    ->ArgName("large")
+    ->Arg(0)
+    ->Arg(1);
+BENCHMARK_TEMPLATE(BM_count_pairs, flat_map<tp, int32_t>)
+    ->ArgName("large")
+    ->Arg(0)
+    ->Arg(1);
@@ -0,0 +1,119 @@
+#include "bench/benchUtil.h"
+#include "flexBPE/flexBPE.h"
+#include <benchmark/benchmark.h>
+
+using namespace flexBPE;
+
+// memory and speed of the lists of the words that contain a pair, as
+// learncodes keeps them, for the hash sets used before and posting_list.
+// the bytes counter is the memory of the lists, without the table that
+// holds them.
+
+namespace {
+size_t allocated = 0;
+
+template <class T> struct counting_allocator {
+  using value_type = T;
+  counting_allocator() = default;
+  template <class U> counting_allocator(const counting_allocator<U> &) {}
+  T *allocate(size_t n) {
+    allocated += n * sizeof(T);
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    allocated -= n * sizeof(T);
+    ::operator delete(p);
+  }
+  template <class U> bool operator==(const counting_allocator<U> &) const {
+    return true;
+  }
+  template <class U> bool operator!=(const counting_allocator<U> &) const {
+    return false;
+  }
+};
+
+using word_set = unordered_set<uint32_t, hash<uint32_t>, equal_to<uint32_t>,
+                               counting_allocator<uint32_t>>;
+
+void add(word_set &words, uint32_t wi) { words.insert(wi); }
+void add(posting_list &words, uint32_t wi) { words.add(wi); }
+
+uint64_t sum(const word_set &words) {
+  uint64_t total = 0;
+  for (uint32_t wi : words)
+    total += wi;
+  return total;
+}
+uint64_t sum(const posting_list &words) {
+  uint64_t total = 0;
+  for (uint32_t wi : words.words)
+    total += wi;
+  return total;
+}
+
+size_t bytes(const flat_map<tp, word_set> &where) {
+  return allocated + where.size() * sizeof(word_set);
+}
+size_t bytes(const flat_map<tp, posting_list> &where) {
+  size_t total = 0;
+  for (auto &x : where)
+    total += x.second.bytes();
+  return total;
+}
+
+// the character pairs of the 200k word types of a large corpus
+const vector<pair<tp, uint32_t>> &postings() {
+  static vector<pair<tp, uint32_t>> found = [] {
+    string text = bench::zipf_corpus(2000000, 200000);
+    flat_map<string_view, uint32_t> ids;
+    vector<pair<tp, uint32_t>> out;
+    size_t start = 0;
+    for_each_separator(text.data(), text.size(), [&](size_t i) {
+      string_view word(text.data() + start, i - start);
+      start = i + 1;
+      auto added = ids.try_emplace(word, ids.size());
+      if (word.empty() || !added.second)
+        return;
+      for (size_t j = 1; j < word.size(); j++)
+        out.emplace_back(tp(uint8_t(word[j - 1]), uint8_t(word[j])),
+                         added.first->second);
+    });
+    return out;
+  }();
+  return found;
+}
+} // namespace
+
+template <class List> static void BM_build_postings(benchmark::State &state) {
+  auto &found = postings();
+  size_t used = 0;
+  for (auto _ : state) {
+    flat_map<tp, List> where;
+    for (auto &x : found)
+      add(where[x.first], x.second);
+    used = bytes(where);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * found.size());
+  state.counters["bytes"] = double(used);
+}
+BENCHMARK_TEMPLATE(BM_build_postings, word_set)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_build_postings, posting_list)
+    ->Unit(benchmark::kMillisecond);
+
+// visits the words of every pair, as the merges do
+template <class List> static void BM_scan_postings(benchmark::State &state) {
+  auto &found = postings();
+  flat_map<tp, List> where;
+  for (auto &x : found)
+    add(where[x.first], x.second);
+  for (auto _ : state) {
+    uint64_t total = 0;
+    for (auto &x : where)
+      total += sum(x.second);
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * found.size());
+}
+BENCHMARK_TEMPLATE(BM_scan_postings, word_set)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_scan_postings, posting_list)
+    ->Unit(benchmark::kMillisecond);
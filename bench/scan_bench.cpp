@@ -0,0 +1,77 @@
+#include "flexBPE/textScan.h"
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <string>
+
+using namespace flexBPE;
+
+// words of 1 to 12 characters, a few of them with 2 and 3 byte characters
+static const std::string &scan_text() {
+  static std::string text = [] {
+    std::mt19937 rng(7);
+    std::string t;
+    const char *multi[] = {"\xc3\x9f", "\xce\xb2", "\xe6\x97\xa5"};
+    while (t.size() < (16 << 20)) {
+      int len = 1 + rng() % 12;
+      for (int i = 0; i < len; i++) {
+        if (rng() % 20 == 0)
+          t += multi[rng() % 3];
+        else
+          t.push_back('a' + rng() % 26);
+      }
+      t.push_back(rng() % 12 == 0 ? '\n' : ' ');
+    }
+    return t;
+  }();
+  return text;
+}
+
+static void BM_separators(benchmark::State &state) {
+  auto &text = scan_text();
+  set_scan_level(scan_level(state.range(0)));
+  for (auto _ : state) {
+    size_t n = 0;
+    for_each_separator(text.data(), text.size(), [&](size_t) { n++; });
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+  set_scan_level(best_scan_level());
+}
+BENCHMARK(BM_separators)
+    ->ArgName("level")
+    ->Arg(kScanScalar)
+    ->Arg(kScanSSE2)
+    ->Arg(kScanAVX2);
+
+static void BM_char_starts(benchmark::State &state) {
+  auto &text = scan_text();
+  set_scan_level(scan_level(state.range(0)));
+  for (auto _ : state) {
+    size_t n = 0;
+    for_each_char_start(text.data(), text.size(), [&](size_t) { n++; });
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+  set_scan_level(best_scan_level());
+}
+BENCHMARK(BM_char_starts)
+    ->ArgName("level")
+    ->Arg(kScanScalar)
+    ->Arg(kScanSSE2)
+    ->Arg(kScanAVX2);
+
+// the loop the text paths used before the kernels, for reference
+static void BM_separators_bytewise(benchmark::State &state) {
+  auto &text = scan_text();
+  for (auto _ : state) {
+    size_t n = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+      if (text[i] == ' ' || text[i] == '\n')
+        n++;
+    }
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+}
+BENCHMARK(BM_separators_bytewise);
@@ -0,0 +1,95 @@
+#include "bpeStats.h"
+
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+namespace flexBPE {
+using namespace std;
+
+const char *phase_name(bpe_phase phase) {
+  static const char *names[kNumPhases] = {
+      "read", "tokenize", "count", "merge", "segment", "output", "decode"};
+  return names[phase];
+}
+
+string bpe_stats::to_json() const {
+  ostringstream out;
+  out << "{\"seconds\": {";
+  for (int p = 0; p < kNumPhases; p++) {
+    out << (p ? ", " : "") << "\"" << phase_name(bpe_phase(p))
+        << "\": " << seconds[p];
+  }
+  out << "}, \"wordsRead\": " << wordsRead
+      << ", \"uniqueWords\": " << uniqueWords << ", \"merges\": " << merges
+      << ", \"livePairs\": " << livePairs
+      << ", \"postingBytes\": " << postingBytes
+      << ", \"wordsSegmented\": " << wordsSegmented
+      << ", \"cacheHits\": " << cacheHits
+      << ", \"cacheMisses\": " << cacheMisses
+      << ", \"peakRssBytes\": " << peakRssBytes << "}";
+  return out.str();
+}
+
+stats_recorder::stats_recorder(bool trace)
+    : trace(trace), created(chrono::steady_clock::now()) {
+  memset(&totals, 0, sizeof(totals));
+}
+
+void stats_recorder::add_time(bpe_phase phase,
+                              chrono::steady_clock::time_point start,
+                              chrono::steady_clock::time_point end) {
+  lock_guard<mutex> guard(lock);
+  totals.seconds[phase] += chrono::duration<double>(end - start).count();
+  if (trace) {
+    events.push_back(
+        {phase, hash<thread::id>{}(this_thread::get_id()),
+         chrono::duration<double, micro>(start - created).count(),
+         chrono::duration<double, micro>(end - start).count()});
+  }
+}
+
+void stats_recorder::count_words_read(uint64_t total, uint64_t unique) {
+  lock_guard<mutex> guard(lock);
+  totals.wordsRead += total;
+  totals.uniqueWords = unique;
+}
+
+void stats_recorder::count_merges(uint64_t merges, uint64_t livePairs) {
+  lock_guard<mutex> guard(lock);
+  totals.merges += merges;
+  totals.livePairs = livePairs;
+}
+
+void stats_recorder::count_postings(uint64_t bytes) {
+  lock_guard<mutex> guard(lock);
+  totals.postingBytes = bytes;
+}
+
+void stats_recorder::count_segmented(uint64_t words) {
+  lock_guard<mutex> guard(lock);
+  totals.wordsSegmented += words;
+}
+
+bpe_stats stats_recorder::snapshot() const {
+  lock_guard<mutex> guard(lock);
+  return totals;
+}
+
+string stats_recorder::trace_json() const {
+  lock_guard<mutex> guard(lock);
+  ostringstream out;
+  out << "{\"traceEvents\": [";
+  for (size_t i = 0; i < events.size(); i++) {
+    auto &e = events[i];
+    out << (i ? ",\n" : "\n") << "{\"name\": \"" << phase_name(e.phase)
+        << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << (e.thread & 0xffffff)
+        << ", \"ts\": " << e.startMicros << ", \"dur\": " << e.durationMicros
+        << "}";
+  }
+  out << "\n]}\n";
+  return out.str();
+}
+
+} // namespace flexBPE
@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace flexBPE {
+
+using namespace std;
+
+// the phases a trainer spends its time in
+enum bpe_phase {
+  kPhaseRead,
+  kPhaseTokenize,
+  kPhaseCount,
+  kPhaseMerge,
+  kPhaseSegment,
+  kPhaseOutput,
+  kPhaseDecode,
+  kNumPhases
+};
+
+const char *phase_name(bpe_phase phase);
+
+struct bpe_stats {
+  // wall seconds spent in each phase, summed over the calls and threads
+  double seconds[kNumPhases];
+  uint64_t wordsRead;
+  uint64_t uniqueWords;
+  uint64_t merges;
+  // pairs with a count when learncodes finished
+  uint64_t livePairs;
+  // memory held by the lists of the words of every pair after the first count
+  uint64_t postingBytes;
+  // words encoded by the apply functions
+  uint64_t wordsSegmented;
+  uint64_t cacheHits;
+  uint64_t cacheMisses;
+  // of the whole process
+  uint64_t peakRssBytes;
+
+  string to_json() const;
+};
+
+// collects the timings and counters of a trainer while stats are enabled.
+// with tracing, every timed span is also kept as a Chrome trace event.
+class stats_recorder {
+public:
+  explicit stats_recorder(bool trace);
+
+  void add_time(bpe_phase phase, chrono::steady_clock::time_point start,
+                chrono::steady_clock::time_point end);
+  void count_words_read(uint64_t total, uint64_t unique);
+  void count_merges(uint64_t merges, uint64_t livePairs);
+  void count_postings(uint64_t bytes);
+  void count_segmented(uint64_t words);
+
+  // the cache counters and peak memory are filled in by the caller
+  bpe_stats snapshot() const;
+  // trace events in the Chrome trace event format, see chrome://tracing
+  string trace_json() const;
+
+private:
+  struct trace_event {
+    bpe_phase phase;
+    uint64_t thread;
+    double startMicros;
+    double durationMicros;
+  };
+
+  mutable mutex lock;
+  bool trace;
+  chrono::steady_clock::time_point created;
+  bpe_stats totals;
+  vector<trace_event> events;
+};
+
+// times the enclosing scope as one span of phase, a null recorder makes it a
+// no-op
+class phase_timer {
+public:
+  phase_timer(stats_recorder *recorder, bpe_phase phase)
+      : recorder(recorder), phase(phase) {
+    if (recorder)
+      start = chrono::steady_clock::now();
+  }
+  ~phase_timer() {
+    if (recorder)
+      recorder->add_time(phase, start, chrono::steady_clock::now());
+  }
+  phase_timer(const phase_timer &) = delete;
+  phase_timer &operator=(const phase_timer &) = delete;
+
+private:
+  stats_recorder *recorder;
+  bpe_phase phase;
+  chrono::steady_clock::time_point start;
+};
+
+} // namespace flexBPE
@@ -0,0 +1,360 @@
+#include "compiledCodes.h"
+#include "flatMap.h"
+#include "stringArena.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+
+namespace flexBPE {
+using namespace std;
+
+constexpr char compiled_codes::kMagic[8];
+
+namespace {
+size_t table_size(size_t n) {
+  // at most half full
+  size_t slots = 2;
+  while (slots < 2 * n)
+    slots *= 2;
+  return slots;
+}
+
+size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+} // namespace
+
+compiled_codes::~compiled_codes() { release(); }
+
+compiled_codes::compiled_codes(compiled_codes &&other) noexcept {
+  *this = move(other);
+}
+
+compiled_codes &compiled_codes::operator=(compiled_codes &&other) noexcept {
+  if (this != &other) {
+    release();
+    owned = move(other.owned);
+    base = other.base;
+    bytes = other.bytes;
+    mapped = other.mapped;
+    other.base = nullptr;
+    other.bytes = 0;
+    other.mapped = false;
+    other.bind();
+    bind();
+  }
+  return *this;
+}
+
+void compiled_codes::release() {
+  if (mapped)
+    munmap(const_cast<char *>(base), bytes);
+  owned.clear();
+  base = nullptr;
+  bytes = 0;
+  mapped = false;
+  bind();
+}
+
+void compiled_codes::bind() {
+  if (base == nullptr) {
+    head = nullptr;
+    offsets = nullptr;
+    infos = nullptr;
+    symbolSlots = nullptr;
+    mergeSlots = nullptr;
+    text = nullptr;
+    expansionOffsets = nullptr;
+    expansionIds = nullptr;
+    return;
+  }
+  head = reinterpret_cast<const header *>(base);
+  offsets = reinterpret_cast<const uint64_t *>(base + head->offsetsAt);
+  infos = reinterpret_cast<const symbol_info *>(base + head->infosAt);
+  symbolSlots = reinterpret_cast<const uint32_t *>(base + head->symbolSlotsAt);
+  mergeSlots = reinterpret_cast<const merge_slot *>(base + head->mergeSlotsAt);
+  text = base + head->textAt;
+  expansionOffsets =
+      reinterpret_cast<const uint32_t *>(base + head->expansionOffsetsAt);
+  expansionIds =
+      reinterpret_cast<const uint32_t *>(base + head->expansionIdsAt);
+}
+
+void compiled_codes::build(
+    const vector<pair<pair<string, string>, uint32_t>> &codes,
+    const unordered_map<string, uint32_t> *vocab, const char *endWord,
+    size_t endWordLength, const char *tokenDelim, size_t tokenDelimLength) {
+  // the ids only depend on the codes, not on the order they come in: the
+  // symbols that no code produces come first, by bytes, then the merged
+  // symbols by the rank of their code. the merged strings are built in the
+  // arena.
+  vector<const pair<pair<string, string>, uint32_t> *> ranked;
+  ranked.reserve(codes.size());
+  for (auto &x : codes)
+    ranked.push_back(&x);
+  sort(ranked.begin(), ranked.end(), [](const auto *a, const auto *b) {
+    return a->second < b->second ||
+           (a->second == b->second && a->first < b->first);
+  });
+  string_arena arena;
+  vector<string_view> merged(ranked.size());
+  flat_map<string_view, uint32_t> produced;
+  for (size_t i = 0; i < ranked.size(); i++) {
+    merged[i] = arena.concat(ranked[i]->first.first, ranked[i]->first.second);
+    produced.try_emplace(merged[i], 0);
+  }
+  vector<string_view> atoms;
+  auto add_atom = [&](string_view part) {
+    if (produced.count(part) == 0)
+      atoms.push_back(part);
+  };
+  for (auto *x : ranked) {
+    add_atom(x->first.first);
+    add_atom(x->first.second);
+  }
+  sort(atoms.begin(), atoms.end());
+  atoms.erase(unique(atoms.begin(), atoms.end()), atoms.end());
+
+  vector<string_view> symbols;
+  flat_map<string_view, uint32_t> ids;
+  auto intern = [&](string_view symbol) {
+    auto added = ids.try_emplace(symbol, symbols.size());
+    if (added.second)
+      symbols.push_back(symbol);
+    return added.first->second;
+  };
+  for (auto atom : atoms)
+    intern(atom);
+  for (auto m : merged)
+    intern(m);
+  vector<pair<uint32_t, merge_slot>> merges;
+  for (size_t i = 0; i < ranked.size(); i++) {
+    uint32_t left = intern(ranked[i]->first.first);
+    uint32_t right = intern(ranked[i]->first.second);
+    uint32_t id = intern(merged[i]);
+    merges.push_back({id, {key(left, right), ranked[i]->second, id}});
+  }
+  vector<symbol_info> symbolInfos(symbols.size(), {unknown, unknown, 0});
+  // a symbol is split by the last code that produces it, the merges are in
+  // rank order
+  for (auto &m : merges) {
+    symbolInfos[m.first].left = uint32_t(m.second.key >> 32);
+    symbolInfos[m.first].right = uint32_t(m.second.key);
+  }
+  bool hasVocab = vocab != nullptr && vocab->size() > 0;
+  if (hasVocab) {
+    for (size_t id = 0; id < symbols.size(); id++) {
+      auto &s = symbols[id];
+      if (vocab->count(string(s) + tokenDelim) > 0)
+        symbolInfos[id].flags |= kInVocab;
+      if (vocab->count(string(s.substr(0, s.size() - endWordLength))) > 0)
+        symbolInfos[id].flags |= kFinalInVocab;
+    }
+  }
+
+  // split every symbol into symbols of the vocabulary, for both positions.
+  // a symbol that is not in the vocabulary is undone into the two symbols of
+  // its code, recursively, down to single characters. the left part is never
+  // the end of the word.
+  vector<uint32_t> expOffsets(1, 0), expIds;
+  function<void(uint32_t, bool)> decompose = [&](uint32_t id, bool isFinal) {
+    auto &info = symbolInfos[id];
+    if (info.left == unknown) {
+      expIds.push_back(id);
+      return;
+    }
+    if (symbolInfos[info.left].flags & kInVocab) {
+      expIds.push_back(info.left);
+    } else {
+      decompose(info.left, false);
+    }
+    uint32_t query = isFinal ? kFinalInVocab : kInVocab;
+    if (symbolInfos[info.right].flags & query) {
+      expIds.push_back(info.right);
+    } else {
+      decompose(info.right, isFinal);
+    }
+  };
+  if (hasVocab) {
+    for (uint32_t id = 0; id < symbols.size(); id++) {
+      for (bool isFinal : {false, true}) {
+        if (symbolInfos[id].flags & (isFinal ? kFinalInVocab : kInVocab)) {
+          expIds.push_back(id);
+        } else {
+          decompose(id, isFinal);
+        }
+        expOffsets.push_back(expIds.size());
+      }
+    }
+  }
+
+  // lay out the image
+  size_t nSymbolSlots = table_size(symbols.size());
+  size_t nMergeSlots = table_size(merges.size());
+  size_t textBytes = 0;
+  for (auto &s : symbols)
+    textBytes += s.size();
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.version = kVersion;
+  h.byteOrder = kByteOrder;
+  h.nSymbols = symbols.size();
+  h.nCodes = merges.size();
+  h.symbolSlots = nSymbolSlots;
+  h.mergeSlots = nMergeSlots;
+  h.hasVocab = hasVocab;
+  h.endWordLength = endWordLength;
+  h.tokenDelimLength = tokenDelimLength;
+  strncpy(h.endWord, endWord, sizeof(h.endWord) - 1);
+  strncpy(h.tokenDelim, tokenDelim, sizeof(h.tokenDelim) - 1);
+  h.offsetsAt = align8(sizeof(header));
+  h.infosAt = h.offsetsAt + align8((symbols.size() + 1) * sizeof(uint64_t));
+  h.symbolSlotsAt =
+      h.infosAt + align8(symbols.size() * sizeof(symbol_info));
+  h.mergeSlotsAt = h.symbolSlotsAt + align8(nSymbolSlots * sizeof(uint32_t));
+  h.textAt = h.mergeSlotsAt + nMergeSlots * sizeof(merge_slot);
+  h.expansionOffsetsAt = align8(h.textAt + textBytes);
+  h.expansionIdsAt =
+      h.expansionOffsetsAt + align8(expOffsets.size() * sizeof(uint32_t));
+  h.totalBytes = align8(h.expansionIdsAt + expIds.size() * sizeof(uint32_t));
+
+  release();
+  owned.assign(h.totalBytes / 8, 0);
+  char *out = reinterpret_cast<char *>(owned.data());
+  memcpy(out, &h, sizeof(h));
+  auto *outOffsets = reinterpret_cast<uint64_t *>(out + h.offsetsAt);
+  char *outText = out + h.textAt;
+  uint64_t pos = 0;
+  for (size_t id = 0; id < symbols.size(); id++) {
+    outOffsets[id] = pos;
+    memcpy(outText + pos, symbols[id].data(), symbols[id].size());
+    pos += symbols[id].size();
+  }
+  outOffsets[symbols.size()] = pos;
+  if (!symbolInfos.empty())
+    memcpy(out + h.infosAt, symbolInfos.data(),
+           symbolInfos.size() * sizeof(symbol_info));
+  memcpy(out + h.expansionOffsetsAt, expOffsets.data(),
+         expOffsets.size() * sizeof(uint32_t));
+  if (!expIds.empty())
+    memcpy(out + h.expansionIdsAt, expIds.data(),
+           expIds.size() * sizeof(uint32_t));
+  auto *outSymbolSlots = reinterpret_cast<uint32_t *>(out + h.symbolSlotsAt);
+  fill(outSymbolSlots, outSymbolSlots + nSymbolSlots, unknown);
+  for (uint32_t id = 0; id < symbols.size(); id++) {
+    size_t i = hash_bytes(symbols[id].data(), symbols[id].size()) &
+               (nSymbolSlots - 1);
+    while (outSymbolSlots[i] != unknown)
+      i = (i + 1) & (nSymbolSlots - 1);
+    outSymbolSlots[i] = id;
+  }
+  auto *outMergeSlots = reinterpret_cast<merge_slot *>(out + h.mergeSlotsAt);
+  fill(outMergeSlots, outMergeSlots + nMergeSlots,
+       merge_slot{UINT64_MAX, unknown, unknown});
+  for (auto &m : merges) {
+    size_t i = mix64(m.second.key) & (nMergeSlots - 1);
+    while (outMergeSlots[i].key != UINT64_MAX)
+      i = (i + 1) & (nMergeSlots - 1);
+    outMergeSlots[i] = m.second;
+  }
+
+  base = out;
+  bytes = h.totalBytes;
+  bind();
+}
+
+bool compiled_codes::load(const char *fp) {
+  int fd = open(fp, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open codes file %s\n", fp);
+    exit(EXIT_FAILURE);
+  }
+  char magic[sizeof(kMagic)];
+  if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    close(fd);
+    return false;
+  }
+  struct stat s;
+  fstat(fd, &s);
+  size_t size = s.st_size;
+  void *f = size >= sizeof(header)
+                ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (f == MAP_FAILED) {
+    fprintf(stderr, "Cannot map compiled model %s : %d.\n", fp, errno);
+    exit(EXIT_FAILURE);
+  }
+  auto *h = reinterpret_cast<const header *>(f);
+  if (h->version != kVersion || h->byteOrder != kByteOrder ||
+      h->totalBytes != size) {
+    fprintf(stderr, "Compiled model %s is corrupt or from another version.\n",
+            fp);
+    exit(EXIT_FAILURE);
+  }
+  release();
+  base = reinterpret_cast<const char *>(f);
+  bytes = size;
+  mapped = true;
+  bind();
+  fprintf(stderr, "Mapped %lu codes from the compiled model %s.\n",
+          n_codes(), fp);
+  return true;
+}
+
+void compiled_codes::save(const char *fp) const {
+  ofstream fdOut(fp, ios::binary | ios::trunc);
+  if (!fdOut.is_open()) {
+    fprintf(stderr, "Cannot open output file %s\n", fp);
+    exit(EXIT_FAILURE);
+  }
+  fdOut.write(base, bytes);
+}
+
+bool compiled_codes::matches(const char *endWord, size_t endWordLength,
+                             const char *tokenDelim,
+                             size_t tokenDelimLength) const {
+  return head && head->endWordLength == endWordLength &&
+         head->tokenDelimLength == tokenDelimLength &&
+         strncmp(head->endWord, endWord, sizeof(head->endWord) - 1) == 0 &&
+         strncmp(head->tokenDelim, tokenDelim, sizeof(head->tokenDelim) - 1) ==
+             0;
+}
+
+uint32_t compiled_codes::find(string_view symbol) const {
+  if (head == nullptr)
+    return unknown;
+  size_t mask = head->symbolSlots - 1;
+  for (size_t i = hash_bytes(symbol.data(), symbol.size()) & mask;;
+       i = (i + 1) & mask) {
+    uint32_t id = symbolSlots[i];
+    if (id == unknown || this->symbol(id) == symbol)
+      return id;
+  }
+}
+
+const merge_slot *compiled_codes::find_merge(uint32_t left,
+                                             uint32_t right) const {
+  if (head == nullptr)
+    return nullptr;
+  uint64_t k = key(left, right);
+  size_t mask = head->mergeSlots - 1;
+  for (size_t i = mix64(k) & mask;; i = (i + 1) & mask) {
+    auto &slot = mergeSlots[i];
+    if (slot.key == k)
+      return &slot;
+    if (slot.key == UINT64_MAX)
+      return nullptr;
+  }
+}
+
+} // namespace flexBPE
@@ -0,0 +1,142 @@
+#pragma once
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "stableHash.h"
+
+namespace flexBPE {
+
+using namespace std;
+
+// what the encoder needs to know about a symbol of the codes
+struct symbol_info {
+  // the code that produces the symbol, unknown for single characters
+  uint32_t left;
+  uint32_t right;
+  uint32_t flags;
+};
+
+// a run of symbol ids in a compiled model
+struct id_span {
+  const uint32_t *ids;
+  size_t size;
+  const uint32_t *begin() const { return ids; }
+  const uint32_t *end() const { return ids + size; }
+};
+
+struct merge_slot {
+  uint64_t key;
+  uint32_t rank;
+  uint32_t merged;
+};
+
+// the codes (and the vocabulary) compiled to integer ids for process_bpe.
+// every string that occurs in the codes is a symbol, merges map a pair of
+// symbol ids to the rank of the code and the id of the merged symbol. all
+// tables are open addressing tables in one flat image, which is either
+// built in memory or mapped read-only from a file written by save. with a
+// vocabulary, the image also holds the split of every symbol into symbols
+// of the vocabulary.
+class compiled_codes {
+public:
+  static constexpr uint32_t unknown = UINT32_MAX;
+  // the symbol followed by the token delimiter is in the vocabulary
+  static constexpr uint32_t kInVocab = 1;
+  // the symbol without the end of word is in the vocabulary
+  static constexpr uint32_t kFinalInVocab = 2;
+
+  static uint64_t key(uint32_t left, uint32_t right) {
+    return (uint64_t(left) << 32) | right;
+  }
+
+  compiled_codes() = default;
+  ~compiled_codes();
+  compiled_codes(const compiled_codes &) = delete;
+  compiled_codes &operator=(const compiled_codes &) = delete;
+  compiled_codes(compiled_codes &&other) noexcept;
+  compiled_codes &operator=(compiled_codes &&other) noexcept;
+
+  // codes are (left, right) pairs with their rank, vocab may be null
+  void build(const vector<pair<pair<string, string>, uint32_t>> &codes,
+             const unordered_map<string, uint32_t> *vocab,
+             const char *endWord, size_t endWordLength,
+             const char *tokenDelim, size_t tokenDelimLength);
+  // maps a model written by save, returns false if fp is not a model file
+  bool load(const char *fp);
+  void save(const char *fp) const;
+  bool matches(const char *endWord, size_t endWordLength,
+               const char *tokenDelim, size_t tokenDelimLength) const;
+
+  size_t size() const { return head ? head->nSymbols : 0; }
+  size_t n_codes() const { return head ? head->nCodes : 0; }
+  bool has_vocab() const { return head && head->hasVocab; }
+
+  uint32_t find(string_view symbol) const;
+  // null if there is no code for the pair
+  const merge_slot *find_merge(uint32_t left, uint32_t right) const;
+  string_view symbol(uint32_t id) const {
+    return string_view(text + offsets[id], offsets[id + 1] - offsets[id]);
+  }
+  const symbol_info &info(uint32_t id) const { return infos[id]; }
+  // the symbols that id is split into so that all of them are in the
+  // vocabulary, as the last symbol of a word or not. only with a vocabulary.
+  id_span expansion(uint32_t id, bool isFinal) const {
+    size_t i = 2 * size_t(id) + isFinal;
+    return {expansionIds + expansionOffsets[i],
+            expansionOffsets[i + 1] - expansionOffsets[i]};
+  }
+
+private:
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t nSymbols;
+    uint32_t nCodes;
+    uint32_t symbolSlots;
+    uint32_t mergeSlots;
+    uint32_t hasVocab;
+    uint32_t endWordLength;
+    uint32_t tokenDelimLength;
+    uint32_t reserved;
+    char endWord[32];
+    char tokenDelim[32];
+    uint64_t offsetsAt;
+    uint64_t infosAt;
+    uint64_t symbolSlotsAt;
+    uint64_t mergeSlotsAt;
+    uint64_t textAt;
+    uint64_t expansionOffsetsAt;
+    uint64_t expansionIdsAt;
+    uint64_t totalBytes;
+  };
+  static constexpr char kMagic[8] = {'f', 'l', 'e', 'x', 'B', 'P', 'E', 0};
+  static constexpr uint32_t kVersion = 2;
+  static constexpr uint32_t kByteOrder = 0x01020304;
+
+  void bind();
+  void release();
+
+  // 8 byte aligned storage of a built model, empty when mapped
+  vector<uint64_t> owned;
+  const char *base = nullptr;
+  size_t bytes = 0;
+  bool mapped = false;
+
+  const header *head = nullptr;
+  const uint64_t *offsets = nullptr;
+  const symbol_info *infos = nullptr;
+  const uint32_t *symbolSlots = nullptr;
+  const merge_slot *mergeSlots = nullptr;
+  const char *text = nullptr;
+  const uint32_t *expansionOffsets = nullptr;
+  const uint32_t *expansionIds = nullptr;
+};
+
+} // namespace flexBPE
@@ -0,0 +1,173 @@
+#pragma once
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "stableHash.h"
+
+namespace flexBPE {
+
+using namespace std;
+
+// hash for the flat maps: hash_bytes for strings and mix64 for integers and
+// pairs of 32 bit ids, whose bits are all mixed into the low ones the table
+// uses.
+struct flat_hash {
+  size_t operator()(string_view s) const {
+    return hash_bytes(s.data(), s.size());
+  }
+  size_t operator()(const string &s) const {
+    return hash_bytes(s.data(), s.size());
+  }
+  size_t operator()(uint64_t x) const { return mix64(x); }
+  size_t operator()(const pair<uint32_t, uint32_t> &p) const {
+    return mix64((uint64_t(p.first) << 32) | p.second);
+  }
+};
+
+// open addressing hash map with linear probing. the entries live in one
+// array of at most 3/4 load, a lookup touches one or two cache lines instead
+// of a bucket list and a node. inserting may move the entries, so unlike
+// unordered_map it does not keep references across inserts. the iteration
+// order is the slot order.
+template <class K, class V, class Hash = flat_hash> class flat_map {
+public:
+  using value_type = pair<K, V>;
+
+  template <class Map, class T> class basic_iterator {
+  public:
+    basic_iterator(Map *map, size_t i) : map(map), i(i) { skip(); }
+    T &operator*() const { return map->slots[i]; }
+    T *operator->() const { return &map->slots[i]; }
+    basic_iterator &operator++() {
+      i++;
+      skip();
+      return *this;
+    }
+    bool operator==(const basic_iterator &o) const { return i == o.i; }
+    bool operator!=(const basic_iterator &o) const { return i != o.i; }
+
+  private:
+    friend class flat_map;
+    void skip() {
+      while (i < map->used.size() && !map->used[i])
+        i++;
+    }
+    Map *map;
+    size_t i;
+  };
+  using iterator = basic_iterator<flat_map, value_type>;
+  using const_iterator = basic_iterator<const flat_map, const value_type>;
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, used.size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, used.size()); }
+
+  void clear() {
+    slots.clear();
+    used.clear();
+    n = 0;
+  }
+
+  void reserve(size_t count) {
+    size_t capacity = 16;
+    while (capacity * 3 < count * 4)
+      capacity *= 2;
+    if (capacity > used.size())
+      rehash(capacity);
+  }
+
+  iterator find(const K &key) { return iterator(this, lookup(key)); }
+  const_iterator find(const K &key) const {
+    return const_iterator(this, lookup(key));
+  }
+  size_t count(const K &key) const { return lookup(key) != used.size(); }
+
+  // inserts key with V(args...) if it is missing. the table only grows when
+  // a key is inserted, finding one never moves the entries.
+  template <class... Args>
+  pair<iterator, bool> try_emplace(const K &key, Args &&... args) {
+    size_t i = 0;
+    if (!used.empty()) {
+      for (i = Hash()(key) & mask(); used[i]; i = (i + 1) & mask()) {
+        if (slots[i].first == key)
+          return {iterator(this, i), false};
+      }
+    }
+    if ((n + 1) * 4 > used.size() * 3) {
+      rehash(max<size_t>(16, used.size() * 2));
+      i = Hash()(key) & mask();
+      while (used[i])
+        i = (i + 1) & mask();
+    }
+    slots[i] = value_type(key, V(forward<Args>(args)...));
+    used[i] = 1;
+    n++;
+    return {iterator(this, i), true};
+  }
+  V &operator[](const K &key) { return try_emplace(key).first->second; }
+
+  // removes key by shifting the entries after it back, no tombstones
+  bool erase(const K &key) {
+    size_t i = lookup(key);
+    if (i == used.size())
+      return false;
+    used[i] = 0;
+    slots[i] = value_type();
+    n--;
+    for (size_t j = (i + 1) & mask(); used[j]; j = (j + 1) & mask()) {
+      size_t home = Hash()(slots[j].first) & mask();
+      // the entry at j can move to i if its home is not in (i, j]
+      bool between = i < j ? (home > i && home <= j) : (home > i || home <= j);
+      if (!between) {
+        slots[i] = move(slots[j]);
+        used[i] = 1;
+        used[j] = 0;
+        slots[j] = value_type();
+        i = j;
+      }
+    }
+    return true;
+  }
+
+private:
+  size_t mask() const { return used.size() - 1; }
+
+  size_t lookup(const K &key) const {
+    if (n == 0)
+      return used.size();
+    for (size_t i = Hash()(key) & mask(); used[i]; i = (i + 1) & mask()) {
+      if (slots[i].first == key)
+        return i;
+    }
+    return used.size();
+  }
+
+  void rehash(size_t capacity) {
+    vector<value_type> oldSlots(capacity);
+    vector<uint8_t> oldUsed(capacity, 0);
+    oldSlots.swap(slots);
+    oldUsed.swap(used);
+    for (size_t j = 0; j < oldUsed.size(); j++) {
+      if (!oldUsed[j])
+        continue;
+      size_t i = Hash()(oldSlots[j].first) & mask();
+      while (used[i])
+        i = (i + 1) & mask();
+      slots[i] = move(oldSlots[j]);
+      used[i] = 1;
+    }
+  }
+
+  vector<value_type> slots;
+  vector<uint8_t> used;
+  size_t n = 0;
+};
+
+} // namespace flexBPE
@@ -5,10 +5,10 @@ using namespace std;
 
 BPETrainer::BPETrainer(const char *jEndWord, const size_t jEndWordLength,
                        const char *jTokenDelim, const size_t jTokenDelimLength,
-                       const size_t jThreads, const size_t jMaxPairs)
+                       const size_t jThreads, const size_t /* jMaxPairs */)
     : jEndWord(jEndWord), jEndWordLength(jEndWordLength),
       jTokenDelim(jTokenDelim), jTokenDelimLength(jTokenDelimLength),
-      jThreads(jThreads), jMaxPairs(jMaxPairs) {}
+      jThreads(jThreads) {}
 
 int BPETrainer::safeOpen(const char *file_path, int flags, mode_t mode = 0) {
   int fd = open(file_path, flags, mode);
@@ -19,32 +19,138 @@ int BPETrainer::safeOpen(const char *file_path, int flags, mode_t mode = 0) {
   return fd;
 }
 
-void BPETrainer::readText(const char *fp,
-                          unordered_map<string, uint32_t> &word_count) {
-  string cur_word;
+template <class Map>
+uint64_t BPETrainer::count_words(const char *f, size_t size, Map &word_count,
+                                 string_arena *arena,
+                                 vector<string_view> *first_seen) {
+  // a word that is not followed by a separator is not counted, the callers
+  // only pass buffers that end on a word boundary. new words are copied to
+  // the arena, without one the keys point into f.
   uint64_t total = 0;
-  auto deal_with_char = [&](char cur_char) {
-    if (cur_char == ' ' || cur_char == '\n') {
-      if (cur_word.size() == 0)
-        return;
-      // end of word
-      auto it = word_count.find(cur_word);
-      int count = it != word_count.end() ? it->second : 0;
-      word_count[cur_word] = count + 1;
+  size_t start = 0;
+  for_each_separator(f, size, [&](size_t i) {
+    if (i > start) {
+      string_view word(f + start, i - start);
+      auto it = word_count.find(word);
+      if (it == word_count.end()) {
+        it = word_count.try_emplace(arena ? arena->store(word) : word, 0).first;
+        if (first_seen != nullptr)
+          first_seen->push_back(it->first);
+      }
+      it->second++;
       total++;
-      cur_word.clear();
-    } else {
-      cur_word.push_back(cur_char);
     }
-  };
+    start = i + 1;
+  });
+  return total;
+}
+
+size_t BPETrainer::output_pieces(size_t size) const {
+  // every thread gets a piece, and no piece is larger than a read chunk
+  return max(jThreads, 1 + size / kReadChunkBytes);
+}
+
+void BPETrainer::split_at_separators(const char *f, size_t size, size_t n,
+                                     vector<size_t> &bounds) {
+  // cut the buffer after a separator so that no word straddles two parts
+  bounds.assign(1, 0);
+  for (size_t i = 1; i < n; i++) {
+    size_t pos = max(bounds.back(), i * (size / n));
+    while (pos < size && f[pos] != ' ' && f[pos] != '\n')
+      pos++;
+    bounds.push_back(min(size, pos + 1));
+  }
+  bounds.push_back(size);
+}
+
+uint64_t BPETrainer::count_text(
+    const char *f, size_t size,
+    unordered_map<string_view, uint32_t> &word_count, string_arena &arena) {
+  size_t nShards = min(jThreads, 1 + size / kMinShardBytes);
+  if (nShards <= 1)
+    return count_words(f, size, word_count, &arena, nullptr);
+
+  vector<size_t> bounds;
+  split_at_separators(f, size, nShards, bounds);
+
+  // the shards count views into f, only the merge copies the words
+  vector<flat_map<string_view, uint32_t>> shard_counts(nShards);
+  vector<vector<string_view>> shard_order(nShards);
+  vector<uint64_t> shard_total(nShards, 0);
+  vector<thread> threads;
+  for (size_t i = 0; i < nShards; i++) {
+    threads.emplace_back(
+        [&](size_t s) {
+          shard_total[s] =
+              count_words(f + bounds[s], bounds[s + 1] - bounds[s],
+                          shard_counts[s], nullptr, &shard_order[s]);
+        },
+        i);
+  }
+
+  // merge shards in order of first occurrence, this keeps the iteration
+  // order of word_count (and therefore the token ids of learncodes)
+  // identical to a single threaded pass
+  uint64_t total = 0;
+  for (size_t i = 0; i < nShards; i++) {
+    threads[i].join();
+    for (auto w : shard_order[i]) {
+      auto it = word_count.find(w);
+      if (it == word_count.end())
+        it = word_count.emplace(arena.store(w), 0).first;
+      it->second += shard_counts[i][w];
+    }
+    total += shard_total[i];
+    shard_counts[i].clear();
+  }
+  return total;
+}
+
+void BPETrainer::safeWrite(int fd, const char *data, size_t size,
+                           const char *file_path) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      fprintf(stderr, "Cannot write to output file %s : %d.\n", file_path,
+              errno);
+      exit(EXIT_FAILURE);
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+void BPETrainer::readText(const char *fp,
+                          unordered_map<string_view, uint32_t> &word_count,
+                          string_arena &arena) {
+  phase_timer timer(recorder.get(), kPhaseRead);
+  uint64_t total = 0;
 
   if (string(fp).compare("-") == 0) {
-    for (string line; getline(cin, line);) {
-      for (char c : line) {
-        deal_with_char(c);
-      }
-      deal_with_char('\n');
+    // read stdin in chunks, only the part up to the last separator is
+    // counted, the unfinished word is carried over to the next chunk
+    vector<char> buf(kReadChunkBytes);
+    size_t filled = 0;
+    while (true) {
+      if (filled == buf.size())
+        buf.resize(buf.size() * 2);
+      size_t n = fread(buf.data() + filled, 1, buf.size() - filled, stdin);
+      if (n == 0)
+        break;
+      filled += n;
+      size_t end = filled;
+      while (end > 0 && buf[end - 1] != ' ' && buf[end - 1] != '\n')
+        end--;
+      total += count_text(buf.data(), end, word_count, arena);
+      memmove(buf.data(), buf.data() + end, filled - end);
+      filled -= end;
     }
+    // the last line does not need a trailing newline
+    buf.resize(filled + 1);
+    buf[filled] = '\n';
+    total += count_words(buf.data(), filled + 1, word_count, &arena, nullptr);
   } else {
     int fd = safeOpen(fp, O_RDONLY);
 
@@ -54,205 +160,366 @@ void BPETrainer::readText(const char *fp,
     // fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
 
     size_t size = s.st_size;
-    char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-    for (size_t i = 0; i < size; i++) {
-      deal_with_char(f[i]);
+    if (size > 0) {
+      char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      total = count_text(f, size, word_count, arena);
+      munmap(f, size);
     }
+    close(fd);
   }
   // also send to a log file
   fprintf(stderr, "Read %lu words (%lu unique) from text file.\n", total,
           word_count.size());
+  if (recorder)
+    recorder->count_words_read(total, word_count.size());
 }
 
-using ssp = pair<size_t, uint64_t>;
-
-pair<size_t, uint64_t>
-BPETrainer::output_or_count(unordered_map<string, string> &bpe, size_t size,
-                            char *f, char *fo) {
-  string cur_word;
-  size_t charOut = 0;
-  uint64_t total = 0;
-  for (size_t i = 0; i < size; i++) {
-    auto &cur_char = f[i];
-    if (cur_char == ' ' || cur_char == '\n') {
-      if (cur_word.size() == 0) {
-        if (fo != nullptr)
-          fo[charOut] = cur_char;
-        charOut++;
+template <class F> void BPETrainer::for_each_count(const char *fp, F f) {
+  // a word and its count per line, as getvocab writes them
+  int fd = safeOpen(fp, O_RDONLY);
+  struct stat s;
+  fstat(fd, &s);
+  size_t size = s.st_size;
+  if (size > 0) {
+    char *text = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      fprintf(stderr, "Input memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    size_t start = 0;
+    while (start < size) {
+      auto *nl = static_cast<const char *>(
+          memchr(text + start, '\n', size - start));
+      size_t end = nl == nullptr ? size : nl - text;
+      string_view line(text + start, end - start);
+      start = end + 1;
+      if (line.empty())
         continue;
+      size_t space = line.rfind(' ');
+      bool valid = space != string_view::npos && space > 0 &&
+                   space + 1 < line.size();
+      // counts are checked as they are parsed so that a long one cannot wrap
+      uint64_t count = 0;
+      for (size_t i = space + 1; valid && i < line.size(); i++) {
+        valid = line[i] >= '0' && line[i] <= '9';
+        count = count * 10 + (line[i] - '0');
+        if (valid && count > uint64_t(INT32_MAX)) {
+          fprintf(stderr, "Count above %d in count file %s : %s\n", INT32_MAX,
+                  fp, string(line).c_str());
+          exit(EXIT_FAILURE);
+        }
       }
-      // end of word : write bpe to output
-      auto it = bpe.find(cur_word);
-      assert(it != bpe.end());
-      for (auto x : it->second) {
-        if (fo != nullptr)
-          fo[charOut] = x;
-        charOut++;
+      if (!valid) {
+        fprintf(stderr, "Invalid line in count file %s : %s\n", fp,
+                string(line).c_str());
+        exit(EXIT_FAILURE);
       }
-      if (fo != nullptr)
-        fo[charOut] = cur_char;
-      charOut++;
+      f(line.substr(0, space), count);
+    }
+    munmap(text, size);
+  }
+  close(fd);
+}
 
+uint64_t BPETrainer::output_words(
+    const unordered_map<string_view, uint32_t> &word_ids,
+    const vector<string> &encoded, const char *f, size_t size, string &out) {
+  // a word without a trailing separator is not written
+  uint64_t total = 0;
+  size_t start = 0;
+  for_each_separator(f, size, [&](size_t i) {
+    if (i > start) {
+      // end of word : write bpe to output
+      auto it = word_ids.find(string_view(f + start, i - start));
+      assert(it != word_ids.end());
+      out.append(encoded[it->second]);
       total++;
-      cur_word.clear();
-    } else {
-      cur_word.push_back(cur_char);
     }
-  }
-  return make_pair(charOut, total);
+    out.push_back(f[i]);
+    start = i + 1;
+  });
+  return total;
 }
 
-void BPETrainer::outputText(const char *fpo, const char *fp,
-                            unordered_map<string, string> &bpe) {
+void BPETrainer::outputText(
+    const char *fpo, const char *fp,
+    const unordered_map<string_view, uint32_t> &word_ids,
+    const vector<string> &encoded) {
+  phase_timer timer(recorder.get(), kPhaseOutput);
   int fd = safeOpen(fp, O_RDONLY);
-  auto fdOut = safeOpen(fpo, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  auto fdOut = safeOpen(fpo, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
   struct stat s;
   fstat(fd, &s);
 
   fprintf(stderr, "Applying BPE to %s ...\n", fp);
-  auto size = s.st_size;
-  char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-  auto p = output_or_count(bpe, size, f, nullptr);
-  size_t out_size = p.first;
-
-  if (ftruncate(fdOut, out_size) < 0) {
-    fprintf(stderr, "Couldn't truncate output file %s to size %lu\n", fpo,
-            out_size);
-    exit(EXIT_FAILURE);
+  size_t size = s.st_size;
+  char *f = nullptr;
+  if (size > 0) {
+    f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f == MAP_FAILED) {
+      fprintf(stderr, "Input memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
   }
 
-  char *fo = (char *)mmap(NULL, out_size, PROT_WRITE, MAP_SHARED, fdOut, 0);
-  if (fo == MAP_FAILED) {
-    fprintf(stderr, "Output memory map failed : %d.\n", errno);
-    exit(EXIT_FAILURE);
+  // the input is cut into pieces at word boundaries. every round, jThreads
+  // pieces are encoded in parallel into their own buffer, the buffers are
+  // then appended to the output in order.
+  vector<size_t> bounds;
+  split_at_separators(f, size, output_pieces(size), bounds);
+  size_t nPieces = bounds.size() - 1;
+  vector<string> outs(jThreads);
+  vector<uint64_t> totals(jThreads);
+  uint64_t total = 0;
+  for (size_t round = 0; round < nPieces; round += jThreads) {
+    size_t nParts = min(jThreads, nPieces - round);
+    vector<thread> threads;
+    for (size_t i = 0; i < nParts; i++) {
+      threads.emplace_back(
+          [&](size_t part) {
+            size_t piece = round + part;
+            outs[part].clear();
+            totals[part] =
+                output_words(word_ids, encoded, f + bounds[piece],
+                             bounds[piece + 1] - bounds[piece], outs[part]);
+          },
+          i);
+    }
+    for (size_t i = 0; i < nParts; i++) {
+      threads[i].join();
+      safeWrite(fdOut, outs[i].data(), outs[i].size(), fpo);
+      total += totals[i];
+    }
   }
-  p = output_or_count(bpe, size, f, fo);
-  fprintf(stderr, "Modified %lu words from text file.\n", p.second);
-  munmap(fo, out_size);
-  munmap(f, size);
+  fprintf(stderr, "Modified %lu words from text file.\n", total);
+  if (size > 0)
+    munmap(f, size);
   close(fdOut);
   close(fd);
 }
 
-void BPETrainer::tokenize(const unordered_map<string, uint32_t> &word_count,
-                          unordered_map<string, uint32_t> &token_to_int,
-                          vector<string> &int_to_token,
-                          vector<list<uint32_t>> &words,
-                          vector<int32_t> &counts) {
+uint64_t BPETrainer::output_ids(
+    const unordered_map<string_view, uint32_t> &word_ids,
+    const vector<vector<uint32_t>> &encoded, const char *f, size_t size,
+    vector<uint32_t> &ids, vector<uint64_t> &lineEnds) {
+  // like output_words, lineEnds gets the number of ids at every newline
+  uint64_t total = 0;
+  size_t start = 0;
+  for_each_separator(f, size, [&](size_t i) {
+    if (i > start) {
+      auto it = word_ids.find(string_view(f + start, i - start));
+      assert(it != word_ids.end());
+      auto &word = encoded[it->second];
+      ids.insert(ids.end(), word.begin(), word.end());
+      total++;
+    }
+    if (f[i] == '\n')
+      lineEnds.push_back(ids.size());
+    start = i + 1;
+  });
+  return total;
+}
+
+void BPETrainer::tokenize(
+    const unordered_map<string_view, uint32_t> &word_count,
+    string_arena &arena, vector<string_view> &int_to_token, flat_words &words,
+    vector<int32_t> &counts) {
+  // the tokens of the characters point into the words, only the last
+  // characters with the end of word are stored in the arena. those are
+  // looked up by the character alone in final_to_int.
+  flat_map<string_view, uint32_t> token_to_int, final_to_int;
+  words.offsets.reserve(word_count.size());
+  words.lengths.reserve(word_count.size());
+  counts.reserve(word_count.size());
   for (auto &x : word_count) {
     auto &word = x.first;
 
-    words.push_back(list<uint32_t>());
-    auto &current_word = words.back();
+    words.offsets.push_back(words.symbols.size());
     counts.push_back(x.second);
 
-    int pos = 0, realLength = 0;
-    int lastStart = 0;
-    while (word[pos]) {
-      bool newChar = (word[pos] & 0xc0) != 0x80; // not a continuation byte
-      realLength += newChar;
-      // new token
-      if (newChar && pos > 0) {
-        auto new_token = word.substr(lastStart, pos - lastStart);
-        if (token_to_int.count(new_token) == 0) {
-          int_to_token.push_back(new_token);
-          token_to_int[new_token] = int_to_token.size() - 1;
-        }
-        current_word.push_back(token_to_int[new_token]);
+    auto intern = [&](string_view c, bool isFinal) {
+      auto &ids = isFinal ? final_to_int : token_to_int;
+      auto it = ids.find(c);
+      if (it == ids.end()) {
+        int_to_token.push_back(isFinal ? arena.concat(c, jEndWord) : c);
+        it = ids.try_emplace(c, int_to_token.size() - 1).first;
+      }
+      words.symbols.push_back(it->second);
+    };
+    // every character is a token, the last one carries the end of word
+    size_t lastStart = 0;
+    for_each_char_start(word.data(), word.size(), [&](size_t pos) {
+      if (pos > 0) {
+        intern(word.substr(lastStart, pos - lastStart), false);
         lastStart = pos;
       }
-      pos++;
-    }
-    auto new_token = word.substr(lastStart, string::npos) + jEndWord;
-    if (token_to_int.count(new_token) == 0) {
-      int_to_token.push_back(new_token);
-      token_to_int[new_token] = int_to_token.size() - 1;
-    }
-    current_word.push_back(token_to_int[new_token]);
+    });
+    intern(word.substr(lastStart), true);
+    words.lengths.push_back(words.symbols.size() - words.offsets.back());
   }
 }
 
-void BPETrainer::tokenize_str(const unordered_map<string, uint32_t> &word_count,
-                              unordered_map<string, vector<string>> &words) {
-  for (auto &x : word_count) {
-    auto &word = x.first;
-    words[word] = vector<string>();
-
-    int pos = 0, realLength = 0;
-    int lastStart = 0;
-    while (word[pos]) {
-      bool newChar = (word[pos] & 0xc0) != 0x80; // not a continuation byte
-      realLength += newChar;
-      // new token
-      if (newChar && pos > 0) {
-        auto new_token = word.substr(lastStart, pos - lastStart);
-        words[word].push_back(new_token);
-        lastStart = pos;
-      }
-      pos++;
+void BPETrainer::count_in_word(
+    const uint32_t *word, uint32_t len, uint32_t wi, int32_t count,
+    pc &pair_counts, vector<pair<int32_t, tp>> &contiguous_counts,
+    pair_words &where) {
+  for (uint32_t j = 1; j < len; j++) {
+    tp cur_pair(word[j - 1], word[j]);
+    auto it = pair_counts.find(cur_pair);
+    if (it == pair_counts.end()) {
+      it = pair_counts.try_emplace(cur_pair, contiguous_counts.size()).first;
+      contiguous_counts.emplace_back(0, cur_pair);
     }
-    auto new_token = word.substr(lastStart, string::npos) + jEndWord;
-    words[word].push_back(new_token);
+    // a word that loses the pair stays listed, see posting_list
+    if (count > 0)
+      where[cur_pair].add(wi);
+    contiguous_counts[it->second].first += count;
   }
 }
 
-void BPETrainer::count_in_word(
-    list<uint32_t> &word, uint32_t wi, uint32_t count, pc &pair_counts,
+void BPETrainer::count_pairs(
+    flat_words &words, const vector<int32_t> &counts, pc &pair_counts,
     vector<pair<int32_t, tp>> &contiguous_counts,
-    unordered_map<tp, unordered_set<uint32_t>, pair_hash> &where) {
-  bool second = false;
-  tp cur_pair;
-  for (uint32_t token : word) {
-    if (second) {
-      cur_pair.first = cur_pair.second;
-    }
-    cur_pair.second = token;
-    if (second) {
-      auto it = pair_counts.find(cur_pair);
-      if (it == pair_counts.end()) {
-        contiguous_counts.emplace_back(0, cur_pair);
-        auto *added = &contiguous_counts.back();
-        pair_counts.emplace(piecewise_construct, forward_as_tuple(cur_pair),
-                            forward_as_tuple(added));
-        where[cur_pair].emplace();
+    pair_words &where) {
+  size_t n = min(jThreads, 1 + words.size() / kMinCountWords);
+  if (n <= 1) {
+    for (uint32_t wi = 0; wi < words.size(); wi++) {
+      count_in_word(words.begin(wi), words.lengths[wi], wi, counts[wi],
+                    pair_counts, contiguous_counts, where);
+    }
+    return;
+  }
+
+  // every thread collects the pairs of a range of words, sorted by the
+  // thread that owns the pair
+  auto owner = [n](const tp &p) {
+    return (p.first * 0x9e3779b1u ^ p.second) % n;
+  };
+  vector<vector<vector<pair<tp, uint32_t>>>> found(
+      n, vector<vector<pair<tp, uint32_t>>>(n));
+  vector<thread> threads;
+  for (size_t t = 0; t < n; t++) {
+    threads.emplace_back(
+        [&](size_t this_thread) {
+          size_t end = (this_thread + 1) * words.size() / n;
+          for (size_t wi = this_thread * words.size() / n; wi < end; wi++) {
+            const uint32_t *word = words.begin(wi);
+            for (uint32_t j = 1; j < words.lengths[wi]; j++) {
+              tp cur_pair(word[j - 1], word[j]);
+              found[this_thread][owner(cur_pair)].emplace_back(cur_pair, wi);
+            }
+          }
+        },
+        t);
+  }
+  for (auto &t : threads)
+    t.join();
+  threads.clear();
+
+  // then every thread counts the pairs it owns
+  // the words come in increasing order, so every list ends up sorted
+  vector<flat_map<tp, pair<int32_t, posting_list>>> owned(n);
+  for (size_t t = 0; t < n; t++) {
+    threads.emplace_back(
+        [&](size_t this_thread) {
+          auto &stats = owned[this_thread];
+          for (size_t from = 0; from < n; from++) {
+            auto &postings = found[from][this_thread];
+            for (auto &x : postings) {
+              auto &entry = stats[x.first];
+              entry.first += counts[x.second];
+              entry.second.add(x.second);
+            }
+            vector<pair<tp, uint32_t>>().swap(postings);
+          }
+        },
+        t);
+  }
+
+  // the owners are disjoint, their posting sets are moved over as they are
+  for (size_t t = 0; t < n; t++) {
+    threads[t].join();
+    for (auto &x : owned[t]) {
+      pair_counts.try_emplace(x.first, contiguous_counts.size());
+      contiguous_counts.emplace_back(x.second.first, x.first);
+      where.try_emplace(x.first, move(x.second.second));
+    }
+    owned[t].clear();
+  }
+}
+
+void BPETrainer::merge_in_word(uint32_t *word, uint32_t &len,
+                               const tp &max_p, uint32_t new_token_id,
+                               int32_t count,
+                               vector<pair<tp, int32_t>> &changes) {
+  // rewrite the word in place, w trails r by the number of merges
+  uint32_t w = 0;
+  for (uint32_t r = 0; r < len;) {
+    if (r + 1 < len && word[r] == max_p.first && word[r + 1] == max_p.second) {
+      // if there is a token before us
+      if (w > 0) {
+        changes.emplace_back(make_pair(word[w - 1], max_p.first), -count);
+        changes.emplace_back(make_pair(word[w - 1], new_token_id), count);
       }
-      if (count > 0) {
-        where[cur_pair].insert(wi);
-      } else {
-        where[cur_pair].erase(wi);
+      // if there is a token after the merged pair
+      if (r + 2 < len) {
+        changes.emplace_back(make_pair(max_p.second, word[r + 2]), -count);
+        changes.emplace_back(make_pair(new_token_id, word[r + 2]), count);
       }
-      pair_counts[cur_pair]->first += count;
+      word[w++] = new_token_id;
+      r += 2;
     } else {
-      second = true;
+      word[w++] = word[r++];
     }
   }
+  len = w;
 }
 
-void BPETrainer::find_maxp(vector<pair<int32_t, tp>> &contiguous_counts,
-                           tp &maxp, int32_t &max_c) {
+void BPETrainer::find_maxp(const pc &pair_counts,
+                           const vector<pair<int32_t, tp>> &contiguous_counts,
+                           pair_heap &heap, tp &maxp, int32_t &max_c) {
+  // every pair with a positive count has an entry in the heap that is at
+  // least its current count. entries above the current count are pushed
+  // back with the current count, entries below it are duplicates of a newer
+  // entry and are dropped.
   max_c = 0;
-  for (auto &x : contiguous_counts) {
-    if (x.first > max_c) {
-      max_c = x.first;
-      maxp = x.second;
-    } else if (x.first == max_c and x.second < maxp) {
-      maxp = x.second;
+  while (!heap.empty()) {
+    auto top = heap.top();
+    int32_t cur = contiguous_counts[pair_counts.find(top.second)->second].first;
+    if (cur == top.first) {
+      max_c = top.first;
+      maxp = top.second;
+      return;
     }
+    heap.pop();
+    if (cur > 0 && cur < top.first)
+      heap.emplace(cur, top.second);
+  }
+}
+
+void BPETrainer::rebuild_heap(vector<pair<int32_t, tp>> &contiguous_counts,
+                              pair_heap &heap) {
+  vector<pair<int32_t, tp>> live;
+  for (auto &x : contiguous_counts) {
+    if (x.first > 0)
+      live.push_back(x);
   }
+  heap = pair_heap(pair_heap_less(), move(live));
 }
 
 void BPETrainer::getvocab(const char *inputFile1, const char *inputFile2,
                           const bool output_vocab) {
   // get vocab
-  unordered_map<string, uint32_t> word_count;
-  readText(inputFile1, word_count);
+  string_arena arena;
+  unordered_map<string_view, uint32_t> word_count;
+  readText(inputFile1, word_count, arena);
   if (strcmp(inputFile2, "") != 0) {
-    readText(inputFile2, word_count);
+    readText(inputFile2, word_count, arena);
   }
-  vocab = word_count;
+  vocab = unordered_map<string, uint32_t>(word_count.begin(), word_count.end());
+  if (codes.size() > 0)
+    compile();
 
   // print sorted vocab if necessary
   if (output_vocab) {
@@ -265,127 +532,217 @@ void BPETrainer::getvocab(const char *inputFile1, const char *inputFile2,
 void BPETrainer::learncodes(const uint32_t kNPairs, const char *inputFile1,
                             const char *inputFile2, const bool replace_vocab,
                             const bool output_codes) {
-  // get vocab
-  unordered_map<string, uint32_t> word_count;
-  readText(inputFile1, word_count);
+  // get vocab, the words and tokens are kept in the arena
+  string_arena arena;
+  unordered_map<string_view, uint32_t> word_count;
+  readText(inputFile1, word_count, arena);
   if (strcmp(inputFile2, "") != 0) {
-    readText(inputFile2, word_count);
+    readText(inputFile2, word_count, arena);
+  }
+  learn(kNPairs, word_count, arena, replace_vocab, output_codes);
+}
+
+void BPETrainer::learncodes_counts(const uint32_t kNPairs,
+                                   const vector<string> &countFiles,
+                                   const bool replace_vocab,
+                                   const bool output_codes) {
+  string_arena arena;
+  unordered_map<string_view, uint32_t> word_count;
+  {
+    phase_timer timer(recorder.get(), kPhaseRead);
+    uint64_t total = 0;
+    for (auto &file : countFiles) {
+      for_each_count(file.c_str(), [&](string_view word, uint64_t count) {
+        auto it = word_count.find(word);
+        if (it == word_count.end())
+          it = word_count.emplace(arena.store(word), 0).first;
+        if (it->second + count > uint64_t(INT32_MAX)) {
+          fprintf(stderr, "Count of %s is above %d.\n", string(word).c_str(),
+                  INT32_MAX);
+          exit(EXIT_FAILURE);
+        }
+        it->second += count;
+        total += count;
+      });
+    }
+    fprintf(stderr, "Read %lu words (%lu unique) from %lu count files.\n",
+            total, word_count.size(), countFiles.size());
+    if (recorder)
+      recorder->count_words_read(total, word_count.size());
   }
+  learn(kNPairs, word_count, arena, replace_vocab, output_codes);
+}
+
+void BPETrainer::learn(const uint32_t kNPairs,
+                       const unordered_map<string_view, uint32_t> &word_count,
+                       string_arena &arena, const bool replace_vocab,
+                       const bool output_codes) {
   if (replace_vocab)
-    vocab = word_count;
+    vocab = unordered_map<string, uint32_t>(word_count.begin(),
+                                            word_count.end());
 
   // a token is an int, it represents a string
-  unordered_map<string, uint32_t> token_to_int;
-  vector<string> int_to_token;
+  vector<string_view> int_to_token;
 
-  vector<list<uint32_t>> words;
+  flat_words words;
   vector<int32_t> counts;
 
-  tokenize(word_count, token_to_int, int_to_token, words, counts);
+  {
+    phase_timer timer(recorder.get(), kPhaseTokenize);
+    tokenize(word_count, arena, int_to_token, words, counts);
+  }
 
   vector<pair<int32_t, tp>> contiguous_counts;
-  contiguous_counts.reserve(jMaxPairs);
 
   pc pair_counts;
-  unordered_map<tp, unordered_set<uint32_t>, pair_hash> where_to_update;
+  pair_words where_to_update;
 
-  tp cur_pair;
   int32_t max_c = 0;
   tp max_p;
-  for (uint32_t wi = 0; wi < words.size(); wi++) {
-    count_in_word(words[wi], wi, counts[wi], pair_counts, contiguous_counts,
-                  where_to_update);
+  pair_heap heap;
+  {
+    phase_timer timer(recorder.get(), kPhaseCount);
+    count_pairs(words, counts, pair_counts, contiguous_counts,
+                where_to_update);
+    rebuild_heap(contiguous_counts, heap);
+    find_maxp(pair_counts, contiguous_counts, heap, max_p, max_c);
   }
-  find_maxp(contiguous_counts, max_p, max_c);
+  if (recorder) {
+    uint64_t bytes = 0;
+    for (auto &x : where_to_update)
+      bytes += x.second.bytes();
+    recorder->count_postings(bytes);
+  }
+  phase_timer mergeTimer(recorder.get(), kPhaseMerge);
+  size_t nMerges = merges.size();
+  // pairs whose count went up during a merge, they get a fresh heap entry
+  vector<tp> increased;
   for (size_t i = 0; i < kNPairs; i++) {
     // stop if no more merges can be made
     if (max_c == 0) {
-      cout << "Stopping because no more merges can be made.  num codes found ("
-           << codes.size() << ") < num codes desired (" << kNPairs << ")"
-           << endl;
+      fprintf(stderr,
+              "Stopping because no more merges can be made. num codes found "
+              "(%lu) < num codes desired (%u)\n",
+              codes.size(), kNPairs);
       break;
     }
     // create new token for pair. replace
-    string s1 = int_to_token[max_p.first];
-    string s2 = int_to_token[max_p.second];
-    auto pair = make_pair(s1, s2);
-    string concat = s1 + s2;
+    string_view s1 = int_to_token[max_p.first];
+    string_view s2 = int_to_token[max_p.second];
+    auto pair = make_pair(string(s1), string(s2));
+    auto new_token = arena.concat(s1, s2);
     codes[pair] = codes.size();
-    reversed_codes[concat] = pair;
-    auto new_token = int_to_token[max_p.first] + int_to_token[max_p.second];
-    merges.push_back(make_pair(s1, s2));
+    reversed_codes[string(new_token)] = pair;
+    merges.push_back(pair);
     if (output_codes)
       cout << s1 << " " << s2 << " " << max_c << endl;
 
+    // a merged token always gets a new id, even if another pair already
+    // made the same string
     uint32_t new_token_id = int_to_token.size();
     int_to_token.push_back(new_token);
-    token_to_int[new_token] = new_token_id;
     max_c = 0;
-    auto change_count = [&](tp pair, int32_t v, uint32_t wi) {
+    auto find_or_add = [&](const tp &pair) {
       auto it = pair_counts.find(pair);
-      if (it != pair_counts.end()) {
-        // assert(it->second + v >= 0);
-        it->second->first += v;
+      if (it == pair_counts.end()) {
+        it = pair_counts.try_emplace(pair, contiguous_counts.size()).first;
+        contiguous_counts.emplace_back(0, pair);
+      }
+      return it->second;
+    };
+    auto change_count = [&](tp pair, int32_t v, uint32_t wi) {
+      if (v > 0) {
+        contiguous_counts[find_or_add(pair)].first += v;
+        where_to_update[pair].add(wi);
+        increased.push_back(pair);
       } else {
-        if (v > 0) {
-          contiguous_counts.emplace_back(v, pair);
-          pair_counts.emplace(piecewise_construct, forward_as_tuple(pair),
-                              forward_as_tuple(&(contiguous_counts.back())));
-          where_to_update[pair] = unordered_set<uint32_t>();
+        auto it = pair_counts.find(pair);
+        if (it != pair_counts.end()) {
+          // assert(contiguous_counts[it->second].first + v >= 0);
+          contiguous_counts[it->second].first += v;
         }
       }
-      if (v > 0)
-        where_to_update[pair].insert(wi);
     };
 
-    for (auto wi : where_to_update[max_p]) {
-      auto &cur_word = words[wi];
-      auto it = cur_word.begin();
-      bool second = false;
-      while (it != cur_word.end()) {
-        if (second) {
-          cur_pair.first = cur_pair.second;
+    // the pair cannot come back once merged, its words are taken out of the
+    // table, which may move its entries while the words are rewritten. they
+    // are made unique so that no word is rewritten twice.
+    auto to_merge = move(where_to_update[max_p].words);
+    where_to_update.erase(max_p);
+    sort(to_merge.begin(), to_merge.end());
+    to_merge.erase(unique(to_merge.begin(), to_merge.end()), to_merge.end());
+    size_t nWorkers = min(jThreads, 1 + to_merge.size() / kMinMergeWords);
+    if (nWorkers <= 1) {
+      vector<std::pair<tp, int32_t>> changes;
+      for (auto wi : to_merge) {
+        changes.clear();
+        merge_in_word(words.begin(wi), words.lengths[wi], max_p, new_token_id,
+                      counts[wi], changes);
+        for (auto &c : changes)
+          change_count(c.first, c.second, wi);
+      }
+    } else {
+      // every worker rewrites a disjoint range of words and sums up its
+      // count changes locally, they are reduced in worker order afterwards
+      vector<flat_map<tp, int32_t>> deltas(nWorkers);
+      vector<vector<std::pair<tp, uint32_t>>> added(nWorkers);
+      vector<thread> threads;
+      for (size_t t = 0; t < nWorkers; t++) {
+        threads.emplace_back(
+            [&](size_t this_thread) {
+              vector<std::pair<tp, int32_t>> changes;
+              size_t end = (this_thread + 1) * to_merge.size() / nWorkers;
+              for (size_t k = this_thread * to_merge.size() / nWorkers; k < end;
+                   k++) {
+                uint32_t wi = to_merge[k];
+                changes.clear();
+                merge_in_word(words.begin(wi), words.lengths[wi], max_p,
+                              new_token_id, counts[wi], changes);
+                for (auto &c : changes) {
+                  deltas[this_thread][c.first] += c.second;
+                  if (c.second > 0)
+                    added[this_thread].emplace_back(c.first, wi);
+                }
+              }
+            },
+            t);
+      }
+      for (size_t t = 0; t < nWorkers; t++) {
+        threads[t].join();
+        for (auto &a : added[t]) {
+          find_or_add(a.first);
+          where_to_update[a.first].add(a.second);
+          increased.push_back(a.first);
         }
-        cur_pair.second = *it;
-
-        if (second) {
-          // found the pair
-          if (cur_pair == max_p) {
-            it--; // points to first element of pair
-            // if there is a token before us
-            if (it != cur_word.begin()) {
-              it--;
-              change_count(make_pair(*it, cur_pair.first), -counts[wi], wi);
-              change_count(make_pair(*it, new_token_id), counts[wi], wi);
-              it++;
-            }
-
-            it = cur_word.insert(it, new_token_id); // it points to new token
-            it++;                    // it points to first element of pair
-            it = cur_word.erase(it); // it points to second element of pair
-            it = cur_word.erase(it); // it points to next value
-
-            // if there is a token after the one we inserted
-            if (it != cur_word.end()) {
-              change_count(make_pair(cur_pair.second, *it), -counts[wi], wi);
-              change_count(make_pair(new_token_id, *it), counts[wi], wi);
-            }
-            cur_pair.second = new_token_id;
-          } else {
-            it++;
-          }
-        } else {
-          second = true;
-          it++;
+        for (auto &d : deltas[t]) {
+          auto it = pair_counts.find(d.first);
+          if (it != pair_counts.end())
+            contiguous_counts[it->second].first += d.second;
         }
       }
     }
 
-    if (pair_counts.find(max_p) != pair_counts.end()) {
-      pair_counts[max_p]->first = 0;
-    }
-    find_maxp(contiguous_counts, max_p, max_c);
+    auto merged = pair_counts.find(max_p);
+    if (merged != pair_counts.end())
+      contiguous_counts[merged->second].first = 0;
+    sort(increased.begin(), increased.end());
+    increased.erase(unique(increased.begin(), increased.end()),
+                    increased.end());
+    for (auto &p : increased)
+      heap.emplace(contiguous_counts[pair_counts.find(p)->second].first, p);
+    increased.clear();
+    // drop the stale entries once they outnumber the pairs
+    if (heap.size() > 2 * contiguous_counts.size())
+      rebuild_heap(contiguous_counts, heap);
+    find_maxp(pair_counts, contiguous_counts, heap, max_p, max_c);
   }
+  if (recorder) {
+    uint64_t live = 0;
+    for (auto &c : contiguous_counts)
+      live += c.first > 0;
+    recorder->count_merges(merges.size() - nMerges, live);
+  }
+  compile();
 }
 
 set<pair<string, int>, decltype(compFunctor)> BPETrainer::get_sortedvocab() {
@@ -396,6 +753,51 @@ set<pair<string, int>, decltype(compFunctor)> BPETrainer::get_sortedvocab() {
   return sorted_vocab;
 }
 
+void BPETrainer::mergevocab(const char *outputFile,
+                            const vector<string> &countFiles) {
+  // the shards are sorted by count, not by word, so they are summed in one
+  // table instead of merged. it only holds the merged vocabulary, which the
+  // sort by count below needs anyway.
+  string_arena arena;
+  flat_map<string_view, uint64_t> word_count;
+  uint64_t total = 0;
+  for (auto &file : countFiles) {
+    for_each_count(file.c_str(), [&](string_view word, uint64_t count) {
+      auto it = word_count.find(word);
+      // the key has to outlive the mapping of the file
+      if (it == word_count.end())
+        it = word_count.try_emplace(arena.store(word), 0).first;
+      it->second += count;
+      total += count;
+    });
+  }
+  fprintf(stderr, "Read %lu words (%lu unique) from %lu count files.\n",
+          total, word_count.size(), countFiles.size());
+
+  // same order as getvocab
+  vector<pair<string_view, uint64_t>> sorted;
+  sorted.reserve(word_count.size());
+  for (auto &x : word_count)
+    sorted.push_back(x);
+  sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  });
+  int fdOut = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  string out;
+  for (auto &x : sorted) {
+    out.append(x.first);
+    out.push_back(' ');
+    out.append(to_string(x.second));
+    out.push_back('\n');
+    if (out.size() >= kReadChunkBytes) {
+      safeWrite(fdOut, out.data(), out.size(), outputFile);
+      out.clear();
+    }
+  }
+  safeWrite(fdOut, out.data(), out.size(), outputFile);
+  close(fdOut);
+}
+
 void BPETrainer::save_vocab(const char *outputFile) {
   fstream fdOut(outputFile, fdOut.trunc | fdOut.in | fdOut.out);
   if (!fdOut.is_open()) {
@@ -486,192 +888,704 @@ void BPETrainer::readCodes(const char *fp,
   fprintf(stderr, "Read %lu codes from the codes file.\n", co.size());
 }
 
-void BPETrainer::decompose(const string s, vector<string> &newSubwords,
-                           bool isFinal) {
-  auto it = reversed_codes.find(s);
-  if (it == reversed_codes.end()) {
-    // TODO this whole block below is just some sanity check
-    // if we cannot un-merge a subword, it has to be a char
-    string s2 = isFinal ? s.substr(0, s.size() - jEndWordLength) : s;
-    int count = 0;
-    for (size_t j = 0; j < s2.size(); j++) {
-      if ((s2[j] & 0xc0) != 0x80) {
-        count++;
-      }
-    }
-    assert(count == 1);
-    newSubwords.push_back(s);
-    return;
-  }
-  assert(it != reversed_codes.end());
-  string token1 = it->second.first;
-  if (vocab.find(token1 + jTokenDelim) == vocab.end()) {
-    decompose(token1, newSubwords, false);
+void BPETrainer::set_cache_capacity(size_t capacity) {
+  if (capacity == 0) {
+    cache.reset();
   } else {
-    newSubwords.push_back(token1);
+    cache.reset(new word_cache(capacity));
   }
-  string token2 = it->second.second;
-  auto query = token2 + jTokenDelim;
-  if (isFinal) {
-    query = token2.substr(0, token2.size() - jEndWordLength);
-  }
-  if (vocab.find(query) == vocab.end()) {
-    decompose(token2, newSubwords, isFinal);
+}
+
+word_cache_stats BPETrainer::cache_stats() const {
+  if (!cache)
+    return {0, 0, 0, 0};
+  return cache->stats();
+}
+
+void BPETrainer::enable_stats(bool trace) {
+  recorder.reset(new stats_recorder(trace));
+}
+
+void BPETrainer::disable_stats() { recorder.reset(); }
+
+bpe_stats BPETrainer::stats() const {
+  bpe_stats s;
+  if (recorder) {
+    s = recorder->snapshot();
   } else {
-    newSubwords.push_back(token2);
+    memset(&s, 0, sizeof(s));
   }
+  auto c = cache_stats();
+  s.cacheHits = c.hits;
+  s.cacheMisses = c.misses;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kilobytes on Linux
+  s.peakRssBytes = uint64_t(usage.ru_maxrss) * 1024;
+  return s;
 }
 
-void BPETrainer::limitVocab(const vector<string> &subwords,
-                            vector<string> &newSubwords) {
-  string query;
-  for (size_t i = 0; i < subwords.size(); i++) {
-    bool isFinal = i == subwords.size() - 1;
-    auto &subword = subwords[i];
-    if (isFinal) {
-      query = subword.substr(0, subword.size() - jEndWordLength);
-    } else {
-      query = subword + jTokenDelim;
+void BPETrainer::save_stats(const char *outputFile) {
+  string json = stats().to_json() + "\n";
+  int fd = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  safeWrite(fd, json.data(), json.size(), outputFile);
+  close(fd);
+}
+
+void BPETrainer::save_trace(const char *outputFile) {
+  string json =
+      recorder ? recorder->trace_json() : "{\"traceEvents\": []}\n";
+  int fd = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  safeWrite(fd, json.data(), json.size(), outputFile);
+  close(fd);
+}
+
+void BPETrainer::compile() {
+  vector<pair<tps, uint32_t>> ranked(codes.begin(), codes.end());
+  compiled.build(ranked, &vocab, jEndWord, jEndWordLength, jTokenDelim,
+                 jTokenDelimLength);
+  nCompiledCodes = codes.size();
+  nCompiledVocab = vocab.size();
+  if (cache)
+    cache->clear();
+}
+
+void BPETrainer::refresh_compiled() {
+  if (codes.size() != nCompiledCodes || vocab.size() != nCompiledVocab)
+    compile();
+}
+
+void BPETrainer::save_compiled(const char *outputFile) {
+  refresh_compiled();
+  compiled.save(outputFile);
+}
+
+void BPETrainer::emit_subword(string_view subword, string &out) {
+  out.append(subword);
+  out.append(jTokenDelim);
+  out.push_back(' ');
+}
+
+void BPETrainer::limitVocab(const vector<word_symbol> &symbols,
+                            vector<word_symbol> &out) {
+  out.clear();
+  for (size_t i = 0; i < symbols.size(); i++) {
+    auto &sym = symbols[i];
+    // characters without codes are kept whether they are in the vocab or not
+    if (sym.id == compiled.unknown) {
+      out.push_back(sym);
+      continue;
     }
-    if (vocab.find(query) == vocab.end()) {
-      decompose(subword, newSubwords, isFinal);
-    } else {
-      newSubwords.push_back(subword);
+    // the split into vocabulary symbols is part of the compiled model
+    uint32_t pos = sym.start;
+    for (uint32_t sub : compiled.expansion(sym.id, i == symbols.size() - 1)) {
+      uint32_t start = pos;
+      pos += compiled.symbol(sub).size();
+      out.push_back({sub, start, pos});
     }
   }
 }
 
-string BPETrainer::process_bpe(vector<string> &subwords) {
-  // merge subWords as much as possible
-  vector<string> newSubwords;
-  while (subwords.size() > 1) {
+void BPETrainer::merge_rescan(vector<word_symbol> &symbols) {
+  while (symbols.size() > 1) {
     // find the best pair
-    int bestPairId = -1;
-    auto bestPair = codes.end(); // TODO ugly hack that works
-    for (size_t i = 0; i < subwords.size() - 1; i++) {
-      auto pair = make_pair(subwords[i], subwords[i + 1]);
-      auto it = codes.find(pair);
-      int pairRank = it == codes.end() ? -1 : it->second;
-      if (pairRank >= 0 &&
-          (bestPairId == -1 || int(bestPair->second) > pairRank)) {
-        bestPair = it;
-        bestPairId = i;
+    uint32_t bestRank = compiled.unknown;
+    uint32_t bestLeft = 0, bestRight = 0, bestMerged = 0;
+    for (size_t i = 0; i + 1 < symbols.size(); i++) {
+      if (symbols[i].id == compiled.unknown ||
+          symbols[i + 1].id == compiled.unknown)
+        continue;
+      auto *code = compiled.find_merge(symbols[i].id, symbols[i + 1].id);
+      if (code != nullptr && code->rank < bestRank) {
+        bestRank = code->rank;
+        bestMerged = code->merged;
+        bestLeft = symbols[i].id;
+        bestRight = symbols[i + 1].id;
       }
     }
     // if we cannot merge anything, stop
-    if (bestPairId == -1) {
+    if (bestRank == compiled.unknown) {
       break;
     }
-    // otherwise, merge subWords
-    bool justMerged = false;
-    newSubwords = vector<string>();
-    for (size_t i = 0; i < subwords.size(); i++) {
-      if ((i + 1 < subwords.size()) && (not justMerged) &&
-          subwords[i] == bestPair->first.first &&
-          subwords[i + 1] == bestPair->first.second) {
-        newSubwords.push_back(subwords[i] + subwords[i + 1]);
-        justMerged = true;
+    // otherwise, merge every occurrence of the pair from left to right
+    size_t w = 0;
+    for (size_t r = 0; r < symbols.size(); r++) {
+      if (w > 0 && symbols[w - 1].id == bestLeft &&
+          symbols[r].id == bestRight) {
+        symbols[w - 1].id = bestMerged;
+        symbols[w - 1].end = symbols[r].end;
       } else {
-        if (not justMerged) {
-          newSubwords.push_back(subwords[i]);
-        }
-        justMerged = false;
+        symbols[w++] = symbols[r];
       }
     }
-    subwords = newSubwords;
+    symbols.resize(w);
   }
-  // check that we are only using words in the dictionary
-  if (vocab.size() > 0) {
-    vector<string> newSubwords;
-    limitVocab(subwords, newSubwords);
-    subwords = newSubwords;
+}
+
+void BPETrainer::merge_heap(word_workspace &ws) {
+  // same result as merge_rescan in O(n log n): the symbols become a linked
+  // list and every adjacent pair with a code is a candidate in a min-heap
+  // ordered by rank and position. all occurrences of the best pair are
+  // merged before the pairs they create become candidates, as in a rescan.
+  auto &symbols = ws.symbols;
+  auto &heap = ws.candidates;
+  auto &created = ws.created;
+  heap.clear();
+  created.clear();
+  for (size_t i = 0; i < symbols.size(); i++) {
+    symbols[i].prev = int32_t(i) - 1;
+    symbols[i].next = i + 1 < symbols.size() ? int32_t(i) + 1 : -1;
   }
-  // concat subWords
-  string result;
-  for (auto x : subwords) {
-    result = result + x + jTokenDelim + " ";
+  auto later = [](const merge_candidate &a, const merge_candidate &b) {
+    return a.rank > b.rank || (a.rank == b.rank && a.pos > b.pos);
+  };
+  auto add_candidate = [&](vector<merge_candidate> &to, int32_t pos) {
+    if (pos < 0 || symbols[pos].next < 0)
+      return;
+    uint32_t left = symbols[pos].id, right = symbols[symbols[pos].next].id;
+    if (left == compiled.unknown || right == compiled.unknown)
+      return;
+    auto *code = compiled.find_merge(left, right);
+    if (code != nullptr)
+      to.push_back({code->rank, uint32_t(pos), left, right, code->merged});
+  };
+  for (size_t i = 0; i + 1 < symbols.size(); i++)
+    add_candidate(heap, i);
+  make_heap(heap.begin(), heap.end(), later);
+
+  while (!heap.empty()) {
+    uint32_t rank = heap.front().rank;
+    while (!heap.empty() && heap.front().rank == rank) {
+      pop_heap(heap.begin(), heap.end(), later);
+      auto c = heap.back();
+      heap.pop_back();
+      auto &sym = symbols[c.pos];
+      // skip candidates that an earlier merge made stale
+      if (sym.next < 0 || sym.id != c.left ||
+          symbols[sym.next].id != c.right || sym.end == 0)
+        continue;
+      auto &right = symbols[sym.next];
+      sym.id = c.merged;
+      sym.end = right.end;
+      right.end = 0; // marks the symbol as merged away
+      sym.next = right.next;
+      if (sym.next >= 0)
+        symbols[sym.next].prev = c.pos;
+      add_candidate(created, sym.prev);
+      add_candidate(created, c.pos);
+    }
+    for (auto &c : created) {
+      heap.push_back(c);
+      push_heap(heap.begin(), heap.end(), later);
+    }
+    created.clear();
   }
-  return result.substr(
-      0,
-      result.size() - jEndWordLength - jTokenDelimLength - 1 // "</w>@@ "
-  );
+
+  // compact the surviving symbols, the first one is never merged away
+  size_t w = 0;
+  for (int32_t i = 0; i >= 0; i = symbols[i].next)
+    symbols[w++] = symbols[i];
+  symbols.resize(w);
 }
 
-void BPETrainer::applybpe(const char *outputFile, const char *inputFile) {
-  // read input file words
-  unordered_map<string, uint32_t> word_count;
-  readText(inputFile, word_count);
+void BPETrainer::segment(const char *word, size_t len, word_workspace &ws) {
+  // split the word into characters, the last one carries the end of word
+  auto &text = ws.text;
+  text.assign(word, len);
+  text.append(jEndWord);
+  auto &symbols = ws.symbols;
+  symbols.clear();
+  for_each_char_start(word, len, [&](size_t pos) {
+    if (!symbols.empty())
+      symbols.back().end = pos;
+    symbols.push_back({compiled.unknown, uint32_t(pos), 0});
+  });
+  if (symbols.empty())
+    symbols.push_back({compiled.unknown, 0, 0});
+  symbols.back().end = text.size();
+  for (auto &sym : symbols) {
+    sym.id = compiled.find(
+        string_view(text.data() + sym.start, sym.end - sym.start));
+  }
 
-  // tokenize
-  unordered_map<string, vector<string>> bpeTok;
-  tokenize_str(word_count, bpeTok);
+  // merge subWords as much as possible
+  if (symbols.size() < kMinHeapMergeSymbols) {
+    merge_rescan(symbols);
+  } else {
+    merge_heap(ws);
+  }
 
-  vector<pair<string, vector<string>>> bpeTokVec;
-  for (auto x : bpeTok) {
-    bpeTokVec.push_back(x);
+  if (compiled.has_vocab()) {
+    // check that we are only using words in the dictionary
+    limitVocab(symbols, ws.restricted);
+    symbols.swap(ws.restricted);
   }
+}
 
-  // apply BPE codes to each word
-  unordered_map<string, string> bpe[jThreads];
-  vector<thread> threads;
-  for (size_t i = 0; i < jThreads; i++) {
-    threads.emplace_back(
-        [&](size_t this_thread) {
-          for (size_t w = this_thread; w < bpeTokVec.size(); w += jThreads) {
-            auto &x = bpeTokVec[w];
-            bpe[this_thread][x.first] = process_bpe(x.second);
-          }
-        },
-        i);
+void BPETrainer::process_bpe(const char *word, size_t len,
+                             word_workspace &ws, string &out) {
+  segment(word, len, ws);
+  size_t outStart = out.size();
+  for (auto &sym : ws.symbols) {
+    emit_subword(
+        string_view(ws.text.data() + sym.start, sym.end - sym.start), out);
   }
+  // concat subWords, without the trailing "</w>@@ "
+  out.resize(max(outStart, out.size() - jEndWordLength - jTokenDelimLength - 1));
+}
 
-  unordered_map<string, string> final_bpe;
-  for (size_t i = 0; i < jThreads; i++) {
-    threads[i].join();
-    for (auto x : bpe[i]) {
-      final_bpe[x.first] = x.second;
+void BPETrainer::process_ids(const char *word, size_t len,
+                             word_workspace &ws, vector<uint32_t> &ids) {
+  segment(word, len, ws);
+  auto &symbols = ws.symbols;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    if (symbols[i].id != compiled.unknown) {
+      ids.push_back(symbols[i].id);
+    } else {
+      ids.push_back(i + 1 < symbols.size() ? unk_id() : unk_final_id());
     }
   }
+}
+
+uint64_t BPETrainer::encode_text(const char *f, size_t size, word_cache &memo,
+                                 word_workspace &ws, string &out) {
+  // like output_words, a word without a trailing separator is dropped
+  uint64_t total = 0;
+  size_t start = 0;
+  for_each_separator(f, size, [&](size_t i) {
+    if (i > start) {
+      string_view word(f + start, i - start);
+      if (!memo.lookup(word, out)) {
+        size_t encodedStart = out.size();
+        process_bpe(word.data(), word.size(), ws, out);
+        memo.insert(word, string_view(out).substr(encodedStart));
+      }
+      total++;
+    }
+    out.push_back(f[i]);
+    start = i + 1;
+  });
+  return total;
+}
+
+void BPETrainer::applybpe_chunked(const char *outputFile,
+                                  const char *inputFile) {
+  refresh_compiled();
+  bool fromStdin = strcmp(inputFile, "-") == 0;
+  bool toStdout = strcmp(outputFile, "-") == 0;
+  int fd = fromStdin ? STDIN_FILENO : safeOpen(inputFile, O_RDONLY);
+  int fdOut = toStdout
+                  ? STDOUT_FILENO
+                  : safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  fprintf(stderr, "Applying BPE to %s ...\n", inputFile);
+
+  // the input is read in chunks that are cut after their last separator,
+  // every chunk is encoded on jThreads threads and written before the next
+  // one is read. words that were seen recently are not encoded again.
+  word_cache memo(kChunkCacheWords);
+  vector<word_workspace> ws(jThreads);
+  vector<string> outs(jThreads);
+  vector<uint64_t> totals(jThreads);
+  vector<size_t> bounds;
+  vector<char> buf(kReadChunkBytes);
+  size_t filled = 0;
+  uint64_t total = 0;
+  bool eof = false;
+  while (!eof) {
+    if (filled == buf.size())
+      buf.resize(buf.size() * 2);
+    // a pipe returns little at a time, fill the whole buffer so that every
+    // thread gets a share
+    while (filled < buf.size()) {
+      ssize_t n = read(fd, buf.data() + filled, buf.size() - filled);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        fprintf(stderr, "Cannot read text file %s : %d.\n", inputFile, errno);
+        exit(EXIT_FAILURE);
+      }
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      filled += n;
+    }
+    size_t end = filled;
+    while (end > 0 && buf[end - 1] != ' ' && buf[end - 1] != '\n')
+      end--;
+    size_t nParts = min(jThreads, 1 + end / kMinShardBytes);
+    split_at_separators(buf.data(), end, nParts, bounds);
+    phase_timer timer(recorder.get(), kPhaseSegment);
+    vector<thread> threads;
+    for (size_t i = 0; i < nParts; i++) {
+      threads.emplace_back(
+          [&](size_t part) {
+            outs[part].clear();
+            totals[part] =
+                encode_text(buf.data() + bounds[part],
+                            bounds[part + 1] - bounds[part], memo, ws[part],
+                            outs[part]);
+          },
+          i);
+    }
+    for (size_t i = 0; i < nParts; i++) {
+      threads[i].join();
+      safeWrite(fdOut, outs[i].data(), outs[i].size(), outputFile);
+      total += totals[i];
+    }
+    memmove(buf.data(), buf.data() + end, filled - end);
+    filled -= end;
+  }
+  fprintf(stderr, "Modified %lu words from text file.\n", total);
+  if (recorder)
+    recorder->count_segmented(total);
+  if (!fromStdin)
+    close(fd);
+  if (!toStdout)
+    close(fdOut);
+}
+
+void BPETrainer::applybpe(const char *outputFile, const char *inputFile) {
+  refresh_compiled();
+  // pipes and stdin cannot be mapped, they are encoded as they come in
+  struct stat s;
+  if (strcmp(inputFile, "-") == 0 ||
+      (stat(inputFile, &s) == 0 && !S_ISREG(s.st_mode))) {
+    applybpe_chunked(outputFile, inputFile);
+    return;
+  }
+
+  // read input file words, then number them
+  string_arena arena;
+  unordered_map<string_view, uint32_t> word_ids;
+  readText(inputFile, word_ids, arena);
+  vector<string_view> words;
+  words.reserve(word_ids.size());
+  for (auto &x : word_ids) {
+    x.second = words.size();
+    words.push_back(x.first);
+  }
+
+  // apply BPE codes to each word. threads grab blocks of words from a
+  // shared cursor, so long words do not leave the others idle, and write
+  // to the slot of the word.
+  vector<string> encoded(words.size());
+  {
+    phase_timer timer(recorder.get(), kPhaseSegment);
+    atomic<size_t> cursor(0);
+    vector<thread> threads;
+    for (size_t i = 0; i < jThreads; i++) {
+      threads.emplace_back([&]() {
+        word_workspace ws;
+        while (true) {
+          size_t begin = cursor.fetch_add(kApplyBlockWords);
+          if (begin >= words.size())
+            break;
+          size_t end = min(words.size(), begin + kApplyBlockWords);
+          for (size_t w = begin; w < end; w++)
+            process_bpe(words[w].data(), words[w].size(), ws, encoded[w]);
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+  }
+  if (recorder)
+    recorder->count_segmented(words.size());
   // output
-  outputText(outputFile, inputFile, final_bpe);
+  outputText(outputFile, inputFile, word_ids, encoded);
 }
 
-void BPETrainer::applybpe_stream() {
-  string line;
-  while (getline(cin, line)) {
-    vector<string> tmp;
-    tmp.push_back(line);
-    for (auto &l : apply(tmp)) {
-      cout << l << endl;
+void BPETrainer::applybpe_ids(const char *outputFile,
+                              const char *inputFile) {
+  refresh_compiled();
+  // read input file words, then number them
+  string_arena arena;
+  unordered_map<string_view, uint32_t> word_ids;
+  readText(inputFile, word_ids, arena);
+  vector<string_view> words;
+  words.reserve(word_ids.size());
+  for (auto &x : word_ids) {
+    x.second = words.size();
+    words.push_back(x.first);
+  }
+
+  // token ids of each word, shared out as in applybpe
+  vector<vector<uint32_t>> encoded(words.size());
+  {
+    phase_timer timer(recorder.get(), kPhaseSegment);
+    atomic<size_t> cursor(0);
+    vector<thread> threads;
+    for (size_t i = 0; i < jThreads; i++) {
+      threads.emplace_back([&]() {
+        word_workspace ws;
+        while (true) {
+          size_t begin = cursor.fetch_add(kApplyBlockWords);
+          if (begin >= words.size())
+            break;
+          size_t end = min(words.size(), begin + kApplyBlockWords);
+          for (size_t w = begin; w < end; w++)
+            process_ids(words[w].data(), words[w].size(), ws, encoded[w]);
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+  }
+  if (recorder)
+    recorder->count_segmented(words.size());
+
+  phase_timer timer(recorder.get(), kPhaseOutput);
+  int fd = safeOpen(inputFile, O_RDONLY);
+  int fdOut = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  char *f = nullptr;
+  if (size > 0) {
+    f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f == MAP_FAILED) {
+      fprintf(stderr, "Input memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fprintf(stderr, "Applying BPE to %s ...\n", inputFile);
+
+  ids_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, ids_header::kMagic, 8);
+  h.version = ids_header::kVersion;
+  h.idBytes = n_ids() <= (1 << 16) ? 2 : 4;
+  h.idsAt = sizeof(ids_header);
+  // the header is written last, once the counts are known
+  safeWrite(fdOut, reinterpret_cast<const char *>(&h), sizeof(h), outputFile);
+
+  // pieces are converted in rounds of jThreads as in outputText
+  vector<size_t> bounds;
+  split_at_separators(f, size, output_pieces(size), bounds);
+  size_t nPieces = bounds.size() - 1;
+  vector<vector<uint32_t>> ids(jThreads);
+  vector<vector<uint64_t>> lineEnds(jThreads);
+  vector<uint64_t> totals(jThreads);
+  vector<uint16_t> narrow;
+  vector<uint64_t> offsets(1, 0);
+  uint64_t total = 0;
+  for (size_t round = 0; round < nPieces; round += jThreads) {
+    size_t nParts = min(jThreads, nPieces - round);
+    vector<thread> threads;
+    for (size_t i = 0; i < nParts; i++) {
+      threads.emplace_back(
+          [&](size_t part) {
+            size_t piece = round + part;
+            ids[part].clear();
+            lineEnds[part].clear();
+            totals[part] = output_ids(word_ids, encoded, f + bounds[piece],
+                                      bounds[piece + 1] - bounds[piece],
+                                      ids[part], lineEnds[part]);
+          },
+          i);
+    }
+    for (size_t i = 0; i < nParts; i++) {
+      threads[i].join();
+      for (auto end : lineEnds[i])
+        offsets.push_back(h.nIds + end);
+      h.nIds += ids[i].size();
+      if (h.idBytes == 2) {
+        narrow.assign(ids[i].begin(), ids[i].end());
+        safeWrite(fdOut, reinterpret_cast<const char *>(narrow.data()),
+                  narrow.size() * 2, outputFile);
+      } else {
+        safeWrite(fdOut, reinterpret_cast<const char *>(ids[i].data()),
+                  ids[i].size() * 4, outputFile);
+      }
+      total += totals[i];
     }
   }
+  // the last line does not need a trailing newline
+  if (size > 0 && f[size - 1] != '\n')
+    offsets.push_back(h.nIds);
+  h.nLines = offsets.size() - 1;
+
+  size_t idsEnd = h.idsAt + h.nIds * h.idBytes;
+  h.offsetsAt = (idsEnd + 7) & ~size_t(7);
+  const char zeros[8] = {0};
+  safeWrite(fdOut, zeros, h.offsetsAt - idsEnd, outputFile);
+  safeWrite(fdOut, reinterpret_cast<const char *>(offsets.data()),
+            offsets.size() * sizeof(uint64_t), outputFile);
+  if (pwrite(fdOut, &h, sizeof(h), 0) != sizeof(h)) {
+    fprintf(stderr, "Cannot write to output file %s : %d.\n", outputFile,
+            errno);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "Wrote %lu ids for %lu words and %lu lines.\n", h.nIds,
+          total, h.nLines);
+  if (size > 0)
+    munmap(f, size);
+  close(fdOut);
+  close(fd);
 }
 
-string BPETrainer::apply(string &sentence) {
-  string cur = "";
-  vector<string> words;
-  split(words, sentence, ' ');
-  for (size_t i = 0; i < words.size(); i++) {
-    auto word = words[i];
-    vector<string> word_bpes;
-    int pos = 0, realLength = 0;
-    int lastStart = 0;
-    while (word[pos]) {
-      bool newChar = (word[pos] & 0xc0) != 0x80; // not a continuation byte
-      realLength += newChar;
-      if (newChar && pos > 0) {
-        auto new_token = word.substr(lastStart, pos - lastStart);
-        word_bpes.push_back(new_token);
-        lastStart = pos;
+void BPETrainer::applybpe_stream(istream &in, ostream &out,
+                                 size_t batchLines) {
+  refresh_compiled();
+  stream_lines(in, out, batchLines, kPhaseSegment,
+               [this](const string &line, word_workspace &ws, string &res) {
+                 return encode_sentence(line, ws, res);
+               });
+}
+
+void BPETrainer::decode_stream(istream &in, ostream &out, size_t batchLines) {
+  stream_lines(in, out, batchLines, kPhaseDecode,
+               [this](const string &line, word_workspace &, string &res) {
+                 size_t start = res.size();
+                 res.append(line);
+                 res.resize(start + decode_text(&res[start], line.size()));
+                 return uint64_t(0);
+               });
+}
+
+void BPETrainer::stream_lines(
+    istream &in, ostream &out, size_t batchLines, bpe_phase phase,
+    const function<uint64_t(const string &, word_workspace &, string &)>
+        &convert) {
+  // a reader thread cuts the input into batches of lines, jThreads workers
+  // convert them and this thread writes them out in input order. at most
+  // maxInFlight batches are held in memory.
+  batchLines = max<size_t>(1, batchLines);
+  struct stream_batch {
+    size_t seq;
+    vector<string> lines;
+    string encoded;
+  };
+  const size_t maxInFlight = 2 * jThreads;
+  mutex m;
+  condition_variable hasSpace, hasWork, hasDone;
+  queue<unique_ptr<stream_batch>> todo;
+  unordered_map<size_t, unique_ptr<stream_batch>> finished;
+  size_t inFlight = 0, nBatches = 0;
+  bool readerDone = false;
+
+  thread reader([&]() {
+    for (size_t seq = 0;; seq++) {
+      unique_ptr<stream_batch> batch(new stream_batch());
+      batch->seq = seq;
+      string line;
+      while (batch->lines.size() < batchLines && getline(in, line))
+        batch->lines.push_back(move(line));
+      size_t nLines = batch->lines.size();
+      if (nLines > 0) {
+        unique_lock<mutex> lock(m);
+        hasSpace.wait(lock, [&] { return inFlight < maxInFlight; });
+        inFlight++;
+        todo.push(move(batch));
+        hasWork.notify_one();
       }
-      pos++;
+      if (nLines < batchLines) {
+        lock_guard<mutex> lock(m);
+        readerDone = true;
+        nBatches = seq + (nLines > 0);
+        break;
+      }
+    }
+    hasWork.notify_all();
+    hasDone.notify_all();
+  });
+
+  vector<thread> workers;
+  for (size_t i = 0; i < jThreads; i++) {
+    workers.emplace_back([&]() {
+      word_workspace ws;
+      while (true) {
+        unique_ptr<stream_batch> batch;
+        {
+          unique_lock<mutex> lock(m);
+          hasWork.wait(lock, [&] { return !todo.empty() || readerDone; });
+          if (todo.empty())
+            return;
+          batch = move(todo.front());
+          todo.pop();
+        }
+        uint64_t nWords = 0;
+        {
+          phase_timer timer(recorder.get(), phase);
+          for (auto &line : batch->lines) {
+            nWords += convert(line, ws, batch->encoded);
+            batch->encoded.push_back('\n');
+          }
+        }
+        if (recorder && nWords > 0)
+          recorder->count_segmented(nWords);
+        vector<string>().swap(batch->lines);
+        lock_guard<mutex> lock(m);
+        finished[batch->seq] = move(batch);
+        hasDone.notify_all();
+      }
+    });
+  }
+
+  for (size_t next = 0;; next++) {
+    unique_ptr<stream_batch> batch;
+    {
+      unique_lock<mutex> lock(m);
+      hasDone.wait(lock, [&] {
+        return finished.count(next) > 0 || (readerDone && next == nBatches);
+      });
+      if (finished.count(next) == 0)
+        break;
+      batch = move(finished[next]);
+      finished.erase(next);
+    }
+    out.write(batch->encoded.data(), batch->encoded.size());
+    {
+      lock_guard<mutex> lock(m);
+      inFlight--;
     }
-    auto bpe = word.substr(lastStart, string::npos) + jEndWord;
-    word_bpes.push_back(bpe);
-    cur += process_bpe(word_bpes);
-    if (i < words.size() - 1)
-      cur += " ";
+    hasSpace.notify_one();
   }
+  out.flush();
+
+  reader.join();
+  for (auto &w : workers)
+    w.join();
+}
+
+uint64_t BPETrainer::encode_sentence(string_view sentence,
+                                     word_workspace &ws, string &out) {
+  // words are separated by one or more spaces, they are written separated
+  // by exactly one
+  uint64_t nWords = 0;
+  bool first = true;
+  size_t start = 0;
+  while (start < sentence.size()) {
+    size_t end = sentence.find(' ', start);
+    if (end == string_view::npos)
+      end = sentence.size();
+    if (end > start) {
+      string_view word = sentence.substr(start, end - start);
+      if (!first)
+        out.push_back(' ');
+      first = false;
+      nWords++;
+      if (!cache || !cache->lookup(word, out)) {
+        size_t wordStart = out.size();
+        process_bpe(word.data(), word.size(), ws, out);
+        if (cache)
+          cache->insert(word, string_view(out).substr(wordStart));
+      }
+    }
+    start = end + 1;
+  }
+  return nWords;
+}
+
+string BPETrainer::apply(string &sentence) {
+  refresh_compiled();
+  phase_timer timer(recorder.get(), kPhaseSegment);
+  string cur;
+  word_workspace ws;
+  uint64_t nWords = encode_sentence(sentence, ws, cur);
+  if (recorder)
+    recorder->count_segmented(nWords);
   return cur;
 }
 
@@ -683,19 +1597,297 @@ vector<string> BPETrainer::apply(vector<string> &sentences) {
   return res;
 }
 
+void BPETrainer::apply(const vector<string_view> &sentences,
+                       encoded_batch &batch) {
+  refresh_compiled();
+  phase_timer timer(recorder.get(), kPhaseSegment);
+  batch.text.clear();
+  batch.offsets.assign(1, 0);
+  uint64_t nWords = 0;
+  for (auto &s : sentences) {
+    nWords += encode_sentence(s, batch.ws, batch.text);
+    batch.offsets.push_back(batch.text.size());
+  }
+  if (recorder)
+    recorder->count_segmented(nWords);
+}
+
+string BPETrainer::token(uint32_t id) const {
+  if (id >= compiled.size())
+    return "";
+  string_view symbol = compiled.symbol(id);
+  if (symbol.size() >= jEndWordLength &&
+      symbol.substr(symbol.size() - jEndWordLength) == jEndWord)
+    return string(symbol.substr(0, symbol.size() - jEndWordLength));
+  return string(symbol) + jTokenDelim;
+}
+
+vector<uint32_t> BPETrainer::apply_ids(const string &sentence) {
+  refresh_compiled();
+  phase_timer timer(recorder.get(), kPhaseSegment);
+  vector<uint32_t> ids;
+  vector<string> words;
+  split(words, sentence, ' ');
+  word_workspace ws;
+  for (auto &word : words)
+    process_ids(word.data(), word.size(), ws, ids);
+  if (recorder)
+    recorder->count_segmented(words.size());
+  return ids;
+}
+
+void BPETrainer::apply_ids(const vector<string> &sentences,
+                           vector<uint32_t> &ids, vector<size_t> &offsets) {
+  refresh_compiled();
+  phase_timer timer(recorder.get(), kPhaseSegment);
+  vector<string> words;
+  word_workspace ws;
+  uint64_t nWords = 0;
+  if (offsets.empty())
+    offsets.push_back(ids.size());
+  for (auto &s : sentences) {
+    words.clear();
+    split(words, s, ' ');
+    for (auto &word : words)
+      process_ids(word.data(), word.size(), ws, ids);
+    nWords += words.size();
+    offsets.push_back(ids.size());
+  }
+  if (recorder)
+    recorder->count_segmented(nWords);
+}
+
+size_t BPETrainer::decode_text(char *text, size_t size) {
+  // removes the token delimiter where it is followed by a space or ends a
+  // line, as sed -r 's/(@@ )|(@@ ?$)//g' does. the text between two
+  // candidates is found with memchr and moved down in one block.
+  if (jTokenDelimLength == 0)
+    return size;
+  size_t r = 0, w = 0;
+  while (r < size) {
+    auto *hit = static_cast<const char *>(
+        memchr(text + r, jTokenDelim[0], size - r));
+    size_t next = hit == nullptr ? size : hit - text;
+    if (w != r)
+      memmove(text + w, text + r, next - r);
+    w += next - r;
+    r = next;
+    if (r == size)
+      break;
+    if (r + jTokenDelimLength <= size &&
+        memcmp(text + r, jTokenDelim, jTokenDelimLength) == 0) {
+      size_t after = r + jTokenDelimLength;
+      if (after == size || text[after] == '\n') {
+        r = after;
+        continue;
+      }
+      if (text[after] == ' ') {
+        r = after + 1;
+        continue;
+      }
+    }
+    text[w++] = text[r++];
+  }
+  return w;
+}
+
+void BPETrainer::decode_id_range(const uint32_t *ids, size_t n,
+                                 string &out) {
+  // final tokens lose the end of word and are followed by a space, the
+  // others are glued to the next token. unknown characters are dropped, but
+  // one that ends a word still ends it.
+  size_t start = out.size();
+  for (size_t i = 0; i < n; i++) {
+    if (ids[i] >= compiled.size()) {
+      if (ids[i] == unk_final_id())
+        out.push_back(' ');
+      continue;
+    }
+    string_view symbol = compiled.symbol(ids[i]);
+    if (symbol.size() >= jEndWordLength &&
+        symbol.substr(symbol.size() - jEndWordLength) == jEndWord) {
+      out.append(symbol.substr(0, symbol.size() - jEndWordLength));
+      out.push_back(' ');
+    } else {
+      out.append(symbol);
+    }
+  }
+  if (out.size() > start && out.back() == ' ')
+    out.pop_back();
+}
+
+void BPETrainer::decode(string &text) {
+  text.resize(decode_text(&text[0], text.size()));
+}
+
+void BPETrainer::decode(const vector<string_view> &sentences,
+                        encoded_batch &batch) {
+  batch.text.clear();
+  batch.offsets.assign(1, 0);
+  for (auto &s : sentences) {
+    size_t start = batch.text.size();
+    batch.text.append(s);
+    batch.text.resize(start + decode_text(&batch.text[start], s.size()));
+    batch.offsets.push_back(batch.text.size());
+  }
+}
+
+string BPETrainer::decode_ids(const vector<uint32_t> &ids) {
+  refresh_compiled();
+  string out;
+  decode_id_range(ids.data(), ids.size(), out);
+  return out;
+}
+
+void BPETrainer::decode_ids(const vector<uint32_t> &ids,
+                            const vector<size_t> &offsets,
+                            encoded_batch &batch) {
+  refresh_compiled();
+  batch.text.clear();
+  batch.offsets.assign(1, 0);
+  for (size_t i = 0; i + 1 < offsets.size(); i++) {
+    decode_id_range(ids.data() + offsets[i], offsets[i + 1] - offsets[i],
+                    batch.text);
+    batch.offsets.push_back(batch.text.size());
+  }
+}
+
+void BPETrainer::decodebpe(const char *outputFile, const char *inputFile) {
+  refresh_compiled();
+  phase_timer timer(recorder.get(), kPhaseDecode);
+  int fd = safeOpen(inputFile, O_RDONLY);
+  int fdOut = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  char *f = nullptr;
+  if (size > 0) {
+    f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f == MAP_FAILED) {
+      fprintf(stderr, "Input memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  // an id file is decoded line by line, a text file piece by piece. pieces
+  // are converted in rounds of jThreads as in outputText.
+  ids_header h;
+  bool isIds = size >= sizeof(h) && memcmp(f, ids_header::kMagic, 8) == 0;
+  vector<size_t> bounds;
+  const uint64_t *offsets = nullptr;
+  if (isIds) {
+    memcpy(&h, f, sizeof(h));
+    // the ids, then the offsets, both inside the file. written so that the
+    // sizes of a corrupt header cannot overflow.
+    bool valid = h.version == ids_header::kVersion &&
+                 (h.idBytes == 2 || h.idBytes == 4) &&
+                 h.idsAt >= sizeof(h) && h.idsAt <= size &&
+                 h.nIds <= (size - h.idsAt) / h.idBytes &&
+                 h.idsAt + h.nIds * h.idBytes <= h.offsetsAt &&
+                 h.offsetsAt <= size && h.offsetsAt % sizeof(uint64_t) == 0 &&
+                 h.nLines < (size - h.offsetsAt) / sizeof(uint64_t);
+    if (valid) {
+      // every line is a range of the ids
+      offsets = reinterpret_cast<const uint64_t *>(f + h.offsetsAt);
+      for (size_t l = 0; valid && l < h.nLines; l++)
+        valid = offsets[l] <= offsets[l + 1];
+      valid = valid && offsets[h.nLines] <= h.nIds;
+    }
+    if (!valid) {
+      fprintf(stderr, "Id file %s is corrupt or from another version.\n",
+              inputFile);
+      exit(EXIT_FAILURE);
+    }
+    if (compiled.size() == 0) {
+      fprintf(stderr, "Decoding ids needs the codes they were made with.\n");
+      exit(EXIT_FAILURE);
+    }
+    // about kReadChunkBytes of text per piece
+    size_t linesPerPiece = max<size_t>(1, kReadChunkBytes / 16);
+    for (size_t line = 0; line < h.nLines; line += linesPerPiece)
+      bounds.push_back(line);
+    bounds.push_back(h.nLines);
+  } else {
+    split_at_separators(f, size, output_pieces(size), bounds);
+  }
+  fprintf(stderr, "Decoding %s ...\n", inputFile);
+  size_t nPieces = bounds.size() - 1;
+  vector<string> outs(jThreads);
+  vector<uint32_t> wide;
+  for (size_t round = 0; round < nPieces; round += jThreads) {
+    size_t nParts = min(jThreads, nPieces - round);
+    vector<thread> threads;
+    for (size_t i = 0; i < nParts; i++) {
+      threads.emplace_back(
+          [&](size_t part) {
+            size_t piece = round + part;
+            string &out = outs[part];
+            out.clear();
+            if (!isIds) {
+              out.assign(f + bounds[piece], bounds[piece + 1] - bounds[piece]);
+              out.resize(decode_text(&out[0], out.size()));
+              return;
+            }
+            vector<uint32_t> line;
+            for (size_t l = bounds[piece]; l < bounds[piece + 1]; l++) {
+              line.resize(offsets[l + 1] - offsets[l]);
+              const char *at = f + h.idsAt + offsets[l] * h.idBytes;
+              if (h.idBytes == 4) {
+                memcpy(line.data(), at, line.size() * 4);
+              } else {
+                for (size_t j = 0; j < line.size(); j++) {
+                  uint16_t id;
+                  memcpy(&id, at + j * 2, 2);
+                  line[j] = id;
+                }
+              }
+              decode_id_range(line.data(), line.size(), out);
+              out.push_back('\n');
+            }
+          },
+          i);
+    }
+    for (size_t i = 0; i < nParts; i++) {
+      threads[i].join();
+      safeWrite(fdOut, outs[i].data(), outs[i].size(), outputFile);
+    }
+  }
+  if (size > 0)
+    munmap(f, size);
+  close(fdOut);
+  close(fd);
+}
+
 BPEInference::BPEInference(const char *codesPath, const char *vocabPath,
                            const char *jEndWord, const size_t jEndWordLength,
                            const char *jTokenDelim,
                            const size_t jTokenDelimLength,
-                           const size_t jThreads,
-                           const size_t jMaxPairs)
+                           const size_t jThreads, const size_t jMaxPairs,
+                           const size_t jCacheSize)
     : BPETrainer(jEndWord, jEndWordLength, jTokenDelim, jTokenDelimLength,
                  jThreads, jMaxPairs) {
+  set_cache_capacity(jCacheSize);
+  // a compiled model is mapped as it is, it already holds the vocabulary
+  if (compiled.load(codesPath)) {
+    if (!compiled.matches(jEndWord, jEndWordLength, jTokenDelim,
+                          jTokenDelimLength)) {
+      fprintf(stderr, "Compiled model %s was built for other delimiters.\n",
+              codesPath);
+      exit(EXIT_FAILURE);
+    }
+    if (strcmp(vocabPath, "") != 0) {
+      fprintf(stderr, "Compiled model %s already contains its vocabulary.\n",
+              codesPath);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
   if (strcmp(vocabPath, "") != 0) {
     readVocab(vocabPath, vocab);
   }
 
   readCodes(codesPath, codes, reversed_codes);
+  compile();
 };
 
 } // namespace flexBPE
@@ -4,22 +4,35 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/resource.h> // getrusage
 #include <sys/stat.h>
 #include <unistd.h> // ftruncate
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
-#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <set>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "bpeStats.h"
+#include "compiledCodes.h"
+#include "flatMap.h"
+#include "stringArena.h"
+#include "textScan.h"
+#include "wordCache.h"
+
 namespace flexBPE {
 
 using namespace std;
@@ -28,23 +41,134 @@ struct pair_hash {
   template <class T1, class T2> size_t operator()(const pair<T1, T2> &p) const {
     auto h1 = hash<T1>{}(p.first);
     auto h2 = hash<T2>{}(p.second);
-    size_t seed = h1;
-    // boost::hash_combine
-    return h2 + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    // both halves go through the mixer, so every bit of the result depends
+    // on every bit of the two hashes
+    return mix64(h1 * 0x9e3779b97f4a7c15ull ^ h2);
   }
 };
 
 using tp = pair<uint32_t, uint32_t>;
 using tps = pair<string, string>;
-using pc = unordered_map<tp, pair<int32_t, tp> *, pair_hash>;
+// index of a pair in the pair counts of learncodes. the counts grow as new
+// pairs are made, so unlike a pointer into them the index stays valid.
+using pc = flat_map<tp, uint32_t>;
+// the words that contain a pair, as a plain array of word indices. words are
+// only ever added: a word may still be listed after it lost the pair, which
+// costs a no-op merge, and a word added twice in a row is kept once. the
+// list is sorted and made unique whenever it doubled since the last time.
+struct posting_list {
+  vector<uint32_t> words;
+  size_t compacted = 0;
+
+  void add(uint32_t wi) {
+    if (!words.empty() && words.back() == wi)
+      return;
+    words.push_back(wi);
+    if (words.size() >= 2 * compacted + 16)
+      compact();
+  }
+  void compact() {
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    compacted = words.size();
+  }
+  size_t bytes() const {
+    return sizeof(posting_list) + words.capacity() * sizeof(uint32_t);
+  }
+};
+using pair_words = flat_map<tp, posting_list>;
+
+// the words of a corpus as token ids in one contiguous array, word wi is
+// symbols[offsets[wi], offsets[wi] + lengths[wi]) and shrinks in place as
+// pairs are merged
+struct flat_words {
+  vector<uint32_t> symbols;
+  vector<size_t> offsets;
+  vector<uint32_t> lengths;
+
+  size_t size() const { return offsets.size(); }
+  uint32_t *begin(size_t wi) { return symbols.data() + offsets[wi]; }
+};
 
-auto compFunctor = [](pair<string, int> elem1, pair<string, int> elem2) {
+// orders pair counts by count, ties go to the smallest pair
+struct pair_heap_less {
+  bool operator()(const pair<int32_t, tp> &a,
+                  const pair<int32_t, tp> &b) const {
+    return a.first < b.first || (a.first == b.first && a.second > b.second);
+  }
+};
+using pair_heap =
+    priority_queue<pair<int32_t, tp>, vector<pair<int32_t, tp>>,
+                   pair_heap_less>;
+
+// a symbol of a word being encoded, the bytes [start, end) of the word.
+// prev and next link the symbols while merging long words.
+struct word_symbol {
+  uint32_t id;
+  uint32_t start;
+  uint32_t end;
+  int32_t prev = -1;
+  int32_t next = -1;
+};
+
+// a pair of adjacent symbols with a code, starting at symbol pos
+struct merge_candidate {
+  uint32_t rank;
+  uint32_t pos;
+  uint32_t left;
+  uint32_t right;
+  uint32_t merged;
+};
+
+// scratch space for process_bpe, reused across words to avoid allocations
+struct word_workspace {
+  string text;
+  vector<word_symbol> symbols;
+  vector<merge_candidate> candidates;
+  vector<merge_candidate> created;
+  // the symbols split down to the vocabulary
+  vector<word_symbol> restricted;
+};
+
+// output of the batch apply, reused from one batch to the next so that its
+// buffers stop growing. sentence i is text[offsets[i], offsets[i + 1]).
+struct encoded_batch {
+  string text;
+  vector<size_t> offsets;
+  word_workspace ws;
+
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  string_view operator[](size_t i) const {
+    return string_view(text).substr(offsets[i], offsets[i + 1] - offsets[i]);
+  }
+};
+
+// header of the token id files written by applybpe_ids. ids are stored as
+// uint16 when they all fit, else uint32, starting at idsAt. line i holds the
+// ids [offsets[i], offsets[i + 1]), offsets are nLines + 1 uint64 at
+// offsetsAt.
+struct ids_header {
+  static constexpr char kMagic[8] = {'f', 'l', 'e', 'x', 'I', 'D', 'S', 0};
+  static constexpr uint32_t kVersion = 3;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t idBytes;
+  uint64_t nLines;
+  uint64_t nIds;
+  uint64_t idsAt;
+  uint64_t offsetsAt;
+};
+
+inline auto compFunctor = [](pair<string, int> elem1,
+                             pair<string, int> elem2) {
   return elem1.second > elem2.second ||
          (elem1.second == elem2.second && elem1.first < elem2.first);
 };
 
 class BPETrainer {
 public:
+  // jMaxPairs is no longer used, the pair counts of learncodes grow as needed
   explicit BPETrainer(const char *jEndWord = "</w>",
                       const size_t jEndWordLength = 4,
                       const char *jTokenDelim = "@@",
@@ -56,14 +180,44 @@ public:
   void learncodes(const uint32_t kNPairs, const char *inputFile1,
                   const char *inputFile2, const bool replace_vocab = false,
                   const bool output_codes = false);
+  // learns codes from word counts instead of text, countFiles are written by
+  // getvocab or mergevocab. the counts of a word in several files are summed.
+  // ties between pairs depend on the order words are first seen in, so they
+  // may be broken differently than when learning from the text.
+  void learncodes_counts(const uint32_t kNPairs,
+                         const vector<string> &countFiles,
+                         const bool replace_vocab = false,
+                         const bool output_codes = false);
   void printcodes();
 
   void getvocab(const char *inputFile1, const char *inputFile2,
                 const bool = false);
+  // sums the word counts of countFiles, e.g. the getvocab output of the
+  // shards of a corpus, and writes them to outputFile in the same format.
+  // every count read must be at most INT32_MAX, as learncodes_counts needs.
+  void mergevocab(const char *outputFile, const vector<string> &countFiles);
 
   void applybpe(const char *outputFile, const char *inputFile);
+  // same output as applybpe, but reads the input in chunks and writes as it
+  // goes, so memory stays bounded. either file may be "-" for stdin/stdout.
+  void applybpe_chunked(const char *outputFile, const char *inputFile);
 
-  void applybpe_stream();
+  // writes the token ids of every line of inputFile to outputFile, see
+  // ids_header for the format
+  void applybpe_ids(const char *outputFile, const char *inputFile);
+
+  // encodes in line by line to out, batchLines lines at a time per thread.
+  // a batchLines of 0 is taken as 1.
+  void applybpe_stream(istream &in = cin, ostream &out = cout,
+                       size_t batchLines = 1024);
+
+  // the inverse of applybpe: writes inputFile with the token delimiters
+  // joined back into words. inputFile may also be an id file written by
+  // applybpe_ids, which needs the codes it was made with.
+  void decodebpe(const char *outputFile, const char *inputFile);
+  // decodes in line by line to out like applybpe_stream
+  void decode_stream(istream &in = cin, ostream &out = cout,
+                     size_t batchLines = 1024);
 
   void readVocab(const char *fp, unordered_map<string, uint32_t> &vocab);
 
@@ -77,12 +231,69 @@ public:
   string apply(string &sentence);
 
   vector<string> apply(vector<string> &sentences);
+  // encodes the sentences into batch, replacing its previous content
+  void apply(const vector<string_view> &sentences, encoded_batch &batch);
+
+  // joins the subwords of text back into words, in place
+  void decode(string &text);
+  void decode(const vector<string_view> &sentences, encoded_batch &batch);
+  string decode_ids(const vector<uint32_t> &ids);
+  // sentence i is ids[offsets[i], offsets[i + 1]), as apply_ids writes them
+  void decode_ids(const vector<uint32_t> &ids, const vector<size_t> &offsets,
+                  encoded_batch &batch);
+
+  // token ids are the symbol ids of the compiled model. a symbol that ends
+  // with the end of word is a final subword, any other one is followed by the
+  // token delimiter. characters without codes get unk_id(), or
+  // unk_final_id() when they end the word, so that the word break is kept.
+  uint32_t unk_id() const { return compiled.size(); }
+  uint32_t unk_final_id() const { return compiled.size() + 1; }
+  size_t n_ids() const { return compiled.size() + 2; }
+  // the text of a token as apply writes it, empty for the unknown ids
+  string token(uint32_t id) const;
+  vector<uint32_t> apply_ids(const string &sentence);
+  // appends the ids of all sentences to ids, sentence i is
+  // [offsets[i], offsets[i + 1])
+  void apply_ids(const vector<string> &sentences, vector<uint32_t> &ids,
+                 vector<size_t> &offsets);
+
+  // rebuilds the integer id model used for encoding from codes and vocab.
+  // the apply and decode functions do it themselves when codes or vocab
+  // changed size since the last build, e.g. after readCodes or readVocab.
+  void compile();
+  // writes the model as a binary file that BPEInference can map directly
+  void save_compiled(const char *outputFile);
+
+  // caches the encoding of up to capacity words for apply, 0 disables it
+  void set_cache_capacity(size_t capacity);
+  word_cache_stats cache_stats() const;
+
+  // times the phases of the following calls and counts their work, trace
+  // also keeps every timed span for save_trace. stats are off by default and
+  // cost a null check per phase then.
+  void enable_stats(bool trace = false);
+  void disable_stats();
+  // what was recorded since enable_stats, the cache counters and peak memory
+  // are filled in even when stats are off
+  bpe_stats stats() const;
+  // writes stats() as JSON
+  void save_stats(const char *outputFile);
+  // writes the timed spans as Chrome trace events, see chrome://tracing
+  void save_trace(const char *outputFile);
 
   // Previously serialized to a file
   unordered_map<string, uint32_t> vocab;
   unordered_map<tps, uint32_t, pair_hash> codes;
   unordered_map<string, tps> reversed_codes;
 
+protected:
+  compiled_codes compiled;
+  // the sizes of codes and vocab when compiled was built
+  size_t nCompiledCodes = 0;
+  size_t nCompiledVocab = 0;
+  unique_ptr<word_cache> cache;
+  unique_ptr<stats_recorder> recorder;
+
 private:
   // previous global variables
   const char *jEndWord;
@@ -90,45 +301,111 @@ private:
   const char *jTokenDelim;
   const size_t jTokenDelimLength;
   const size_t jThreads;
-  const size_t jMaxPairs;
+  // readText splits its input into shards of at least this size per thread
+  static constexpr size_t kMinShardBytes = 1 << 20;
+  // stdin and the inputs of applybpe are processed in pieces of this size
+  static constexpr size_t kReadChunkBytes = 1 << 24;
+  // applybpe_chunked remembers the encoding of this many words
+  static constexpr size_t kChunkCacheWords = 1 << 20;
+  // learncodes merges a pair on several threads once every thread gets at
+  // least this many words to rewrite
+  static constexpr size_t kMinMergeWords = 2048;
+  // same for the first count of all pairs
+  static constexpr size_t kMinCountWords = 16384;
+  // applybpe threads take this many words at a time from the shared cursor
+  static constexpr size_t kApplyBlockWords = 64;
+  // words with at least this many characters are merged with a heap
+  static constexpr size_t kMinHeapMergeSymbols = 16;
   // storage for serializing codes
   vector<pair<string, string>> merges;
   // private functions
   int safeOpen(const char *file_path, int flags, mode_t mode);
-  void readText(const char *fp, unordered_map<string, uint32_t> &word_count);
-  std::pair<size_t, uint64_t>
-  output_or_count(unordered_map<string, string> &bpe, size_t size, char *f,
-                  char *fo);
+  void safeWrite(int fd, const char *data, size_t size, const char *file_path);
+  // compiles again if codes or vocab changed since the last compile
+  void refresh_compiled();
+  // the number of pieces a file of size bytes is cut in for the output passes
+  size_t output_pieces(size_t size) const;
+  void split_at_separators(const char *f, size_t size, size_t n,
+                           vector<size_t> &bounds);
+  void readText(const char *fp,
+                unordered_map<string_view, uint32_t> &word_count,
+                string_arena &arena);
+  uint64_t count_text(const char *f, size_t size,
+                      unordered_map<string_view, uint32_t> &word_count,
+                      string_arena &arena);
+  template <class F> void for_each_count(const char *fp, F f);
+  void learn(const uint32_t kNPairs,
+             const unordered_map<string_view, uint32_t> &word_count,
+             string_arena &arena, const bool replace_vocab,
+             const bool output_codes);
+  template <class Map>
+  uint64_t count_words(const char *f, size_t size, Map &word_count,
+                       string_arena *arena, vector<string_view> *first_seen);
+  uint64_t output_words(const unordered_map<string_view, uint32_t> &word_ids,
+                        const vector<string> &encoded, const char *f,
+                        size_t size, string &out);
   void outputText(const char *fpo, const char *fp,
-                  unordered_map<string, string> &bpe);
-  void tokenize(const unordered_map<string, uint32_t> &word_count,
-                unordered_map<string, uint32_t> &token_to_int,
-                vector<string> &int_to_token, vector<list<uint32_t>> &words,
-                vector<int32_t> &counts);
-  void tokenize_str(const unordered_map<string, uint32_t> &word_count,
-                    unordered_map<string, vector<string>> &words);
+                  const unordered_map<string_view, uint32_t> &word_ids,
+                  const vector<string> &encoded);
+  uint64_t output_ids(const unordered_map<string_view, uint32_t> &word_ids,
+                      const vector<vector<uint32_t>> &encoded, const char *f,
+                      size_t size, vector<uint32_t> &ids,
+                      vector<uint64_t> &lineEnds);
+  uint64_t encode_text(const char *f, size_t size, word_cache &memo,
+                       word_workspace &ws, string &out);
+  void tokenize(const unordered_map<string_view, uint32_t> &word_count,
+                string_arena &arena, vector<string_view> &int_to_token,
+                flat_words &words, vector<int32_t> &counts);
   void
-  count_in_word(list<uint32_t> &word, uint32_t wi, uint32_t count,
-                pc &pair_counts, vector<pair<int32_t, tp>> &contiguous_counts,
-                unordered_map<tp, unordered_set<uint32_t>, pair_hash> &where);
-  void find_maxp(vector<pair<int32_t, tp>> &contiguous_counts, tp &maxp,
-                 int32_t &max_c);
+  count_in_word(const uint32_t *word, uint32_t len, uint32_t wi,
+                int32_t count, pc &pair_counts,
+                vector<pair<int32_t, tp>> &contiguous_counts,
+                pair_words &where);
+  void count_pairs(flat_words &words, const vector<int32_t> &counts,
+                   pc &pair_counts,
+                   vector<pair<int32_t, tp>> &contiguous_counts,
+                   pair_words &where);
+  void merge_in_word(uint32_t *word, uint32_t &len, const tp &max_p,
+                     uint32_t new_token_id, int32_t count,
+                     vector<pair<tp, int32_t>> &changes);
+  void find_maxp(const pc &pair_counts,
+                 const vector<pair<int32_t, tp>> &contiguous_counts,
+                 pair_heap &heap, tp &maxp, int32_t &max_c);
+  void rebuild_heap(vector<pair<int32_t, tp>> &contiguous_counts,
+                    pair_heap &heap);
   void split(vector<string> &splits, const string &text, char sep);
-  void decompose(const string s, vector<string> &newSubwords, bool isFinal);
-  void limitVocab(const vector<string> &subwords, vector<string> &newSubwords);
-  string process_bpe(vector<string> &subwords);
+  void emit_subword(string_view subword, string &out);
+  void limitVocab(const vector<word_symbol> &symbols,
+                  vector<word_symbol> &out);
+  void merge_rescan(vector<word_symbol> &symbols);
+  void merge_heap(word_workspace &ws);
+  void stream_lines(
+      istream &in, ostream &out, size_t batchLines, bpe_phase phase,
+      const function<uint64_t(const string &, word_workspace &, string &)>
+          &convert);
+  size_t decode_text(char *text, size_t size);
+  void decode_id_range(const uint32_t *ids, size_t n, string &out);
+  uint64_t encode_sentence(string_view sentence, word_workspace &ws,
+                           string &out);
+  void segment(const char *word, size_t len, word_workspace &ws);
+  void process_bpe(const char *word, size_t len, word_workspace &ws,
+                   string &out);
+  void process_ids(const char *word, size_t len, word_workspace &ws,
+                   vector<uint32_t> &ids);
   set<pair<string, int>, decltype(compFunctor)> get_sortedvocab();
 };
 
 class BPEInference : public BPETrainer {
 public:
+  // codesPath is either a codes file or a model written by save_compiled,
+  // which is mapped read-only and already contains its vocabulary
   explicit BPEInference(
       const char *codesPath, const char *vocabPath,
       const char *jEndWord = "</w>", const size_t jEndWordLength = 4,
       const char *jTokenDelim = "@@", const size_t jTokenDelimLength = 2,
       const size_t jThreads = max(1, min(10,
                                          int(thread::hardware_concurrency()))),
-      const size_t jMaxPairs = 10000000);
+      const size_t jMaxPairs = 10000000, const size_t jCacheSize = 0);
 };
 
 } // end namespace flexBPE
@@ -11,12 +11,50 @@ void printUsage() {
          "or two text files\n"
       << "learnbpe nCodes input1 [input2]      learn BPE codes from one or two "
          "text files\n"
+      << "learnbpe_counts nCodes counts...     learn BPE codes from the output "
+         "of getvocab or\n"
+      << "                                     mergevocab\n"
+      << "mergevocab output counts...          sum the getvocab output of "
+         "shards of a corpus\n"
       << "applybpe output input codes [vocab]  apply BPE codes to a text file\n"
+      << "applybpe_chunked output input codes [vocab]\n"
+      << "                                     same, in bounded memory, "
+         "input and output may\n"
+      << "                                     be pipes or - for stdin and "
+         "stdout\n"
+      << "applybpe_ids output input codes [vocab]\n"
+      << "                                     write the token ids of every "
+         "line as a binary\n"
+      << "                                     file\n"
       << "applybpe_stream codes [vocab]        apply BPE codes to stdin and "
          "output to stdout\n"
+      << "decode output input [codes]          join subwords back into words, "
+         "input may be an\n"
+      << "                                     id file, which needs its "
+         "codes\n"
+      << "decode_stream                        same from stdin to stdout\n"
+      << "compile output codes [vocab]         write codes and vocab as a "
+         "binary model that\n"
+      << "                                     can be used in place of the "
+         "codes\n"
+      << "\nFLEXBPE_STATS=file and FLEXBPE_TRACE=file write the phase timings "
+         "and counters\nof a command as JSON and as Chrome trace events.\n"
       << endl;
 }
 
+// runs command on model with the stats asked for in the environment
+template <class F> void run(BPETrainer &model, F command) {
+  const char *statsFile = getenv("FLEXBPE_STATS");
+  const char *traceFile = getenv("FLEXBPE_TRACE");
+  if (statsFile || traceFile)
+    model.enable_stats(traceFile != nullptr);
+  command();
+  if (statsFile)
+    model.save_stats(statsFile);
+  if (traceFile)
+    model.save_trace(traceFile);
+}
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     printUsage();
@@ -26,19 +64,61 @@ int main(int argc, char **argv) {
   if (command == "getvocab") {
     assert(argc == 3 || argc == 4);
     BPETrainer trainer = BPETrainer();
-    trainer.getvocab(argv[2], argc == 4 ? argv[3] : "");
+    run(trainer,
+        [&] { trainer.getvocab(argv[2], argc == 4 ? argv[3] : "", true); });
   } else if (command == "learnbpe") {
     assert(argc == 4 || argc == 5);
     BPETrainer trainer = BPETrainer();
-    trainer.learncodes(stoi(argv[2]), argv[3], argc == 5 ? argv[4] : "");
+    run(trainer, [&] {
+      trainer.learncodes(stoi(argv[2]), argv[3], argc == 5 ? argv[4] : "",
+                         false, true);
+    });
+  } else if (command == "learnbpe_counts") {
+    assert(argc >= 4);
+    vector<string> countFiles(argv + 3, argv + argc);
+    BPETrainer trainer = BPETrainer();
+    run(trainer, [&] {
+      trainer.learncodes_counts(stoi(argv[2]), countFiles, false, true);
+    });
+  } else if (command == "mergevocab") {
+    assert(argc >= 4);
+    vector<string> countFiles(argv + 3, argv + argc);
+    BPETrainer trainer = BPETrainer();
+    run(trainer, [&] { trainer.mergevocab(argv[2], countFiles); });
   } else if (command == "applybpe") {
     assert(argc == 5 || argc == 6);
     BPEInference inference = BPEInference(argv[4], argc == 6 ? argv[5] : "");
-    inference.applybpe(argv[2], argv[3]);
+    run(inference, [&] { inference.applybpe(argv[2], argv[3]); });
+  } else if (command == "applybpe_chunked") {
+    assert(argc == 5 || argc == 6);
+    BPEInference inference = BPEInference(argv[4], argc == 6 ? argv[5] : "");
+    run(inference, [&] { inference.applybpe_chunked(argv[2], argv[3]); });
+  } else if (command == "applybpe_ids") {
+    assert(argc == 5 || argc == 6);
+    BPEInference inference = BPEInference(argv[4], argc == 6 ? argv[5] : "");
+    run(inference, [&] { inference.applybpe_ids(argv[2], argv[3]); });
   } else if (command == "applybpe_stream") {
     assert(argc == 3 || argc == 4);
     BPEInference inference = BPEInference(argv[2], argc == 4 ? argv[3] : "");
-    inference.applybpe_stream();
+    inference.set_cache_capacity(1 << 20);
+    run(inference, [&] { inference.applybpe_stream(); });
+  } else if (command == "decode") {
+    assert(argc == 4 || argc == 5);
+    if (argc == 5) {
+      BPEInference inference = BPEInference(argv[4], "");
+      run(inference, [&] { inference.decodebpe(argv[2], argv[3]); });
+    } else {
+      BPETrainer trainer = BPETrainer();
+      run(trainer, [&] { trainer.decodebpe(argv[2], argv[3]); });
+    }
+  } else if (command == "decode_stream") {
+    assert(argc == 2);
+    BPETrainer trainer = BPETrainer();
+    run(trainer, [&] { trainer.decode_stream(); });
+  } else if (command == "compile") {
+    assert(argc == 4 || argc == 5);
+    BPEInference inference = BPEInference(argv[3], argc == 5 ? argv[4] : "");
+    inference.save_compiled(argv[2]);
   } else {
     printUsage();
     exit(EXIT_FAILURE);
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+#include <cstring>
+
+namespace flexBPE {
+
+// hashes that unlike std::hash are the same in every build, so the tables of
+// a compiled model can be written to disk. they also mix every input bit
+// into the low bits, which the power of two tables index with.
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ull;
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ull;
+  x ^= x >> 32;
+  return x;
+}
+
+inline uint64_t hash_bytes(const char *p, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ (n * 0xff51afd7ed558ccdull);
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    h = mix64(h ^ v) + 0x9e3779b97f4a7c15ull;
+  }
+  uint64_t v = 0;
+  memcpy(&v, p, n);
+  return mix64(h ^ v);
+}
+
+} // namespace flexBPE
@@ -0,0 +1,46 @@
+#include "stringArena.h"
+
+#include <cstring>
+
+namespace flexBPE {
+using namespace std;
+
+string_arena::string_arena(size_t blockBytes) : blockBytes(blockBytes) {}
+
+char *string_arena::allocate(size_t n) {
+  stored += n;
+  if (n > left) {
+    // a large string gets a block of its own, the current
+    // block stays in use for the next ones
+    if (n > blockBytes / 4) {
+      blocks.emplace_back(new char[n]);
+      return blocks.back().get();
+    }
+    blocks.emplace_back(new char[blockBytes]);
+    cur = blocks.back().get();
+    left = blockBytes;
+  }
+  char *p = cur;
+  cur += n;
+  left -= n;
+  return p;
+}
+
+string_view string_arena::store(string_view s) {
+  if (s.empty())
+    return string_view();
+  char *p = allocate(s.size());
+  memcpy(p, s.data(), s.size());
+  return string_view(p, s.size());
+}
+
+string_view string_arena::concat(string_view a, string_view b) {
+  if (a.empty() && b.empty())
+    return string_view();
+  char *p = allocate(a.size() + b.size());
+  memcpy(p, a.data(), a.size());
+  memcpy(p + a.size(), b.data(), b.size());
+  return string_view(p, a.size() + b.size());
+}
+
+} // namespace flexBPE
@@ -0,0 +1,36 @@
+#pragma once
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace flexBPE {
+
+using namespace std;
+
+// append-only storage for the words and tokens of the training and vocab
+// structures. strings are packed into large blocks that never move, so the
+// string_views it returns stay valid until the arena is destroyed and can be
+// used as hash table keys.
+class string_arena {
+public:
+  explicit string_arena(size_t blockBytes = 1 << 20);
+
+  // copies s into the arena
+  string_view store(string_view s);
+  // stores a followed by b
+  string_view concat(string_view a, string_view b);
+
+  // bytes of all the strings stored
+  size_t bytes() const { return stored; }
+
+private:
+  char *allocate(size_t n);
+
+  vector<unique_ptr<char[]>> blocks;
+  size_t blockBytes;
+  char *cur = nullptr;
+  size_t left = 0;
+  size_t stored = 0;
+};
+
+} // namespace flexBPE
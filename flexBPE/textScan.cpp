@@ -0,0 +1,109 @@
+#include "textScan.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FLEXBPE_X86 1
+#endif
+
+namespace flexBPE {
+using namespace std;
+
+namespace {
+uint64_t separators_scalar(const char *p) {
+  uint64_t m = 0;
+  for (int i = 0; i < 64; i++)
+    m |= uint64_t(is_separator(p[i])) << i;
+  return m;
+}
+
+uint64_t char_starts_scalar(const char *p) {
+  uint64_t m = 0;
+  for (int i = 0; i < 64; i++)
+    m |= uint64_t(is_char_start(p[i])) << i;
+  return m;
+}
+
+#ifdef FLEXBPE_X86
+__attribute__((target("sse2"))) uint64_t separators_sse2(const char *p) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  uint64_t m = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                               _mm_cmpeq_epi8(v, newline));
+    m |= uint64_t(uint32_t(_mm_movemask_epi8(hit))) << (16 * i);
+  }
+  return m;
+}
+
+// continuation bytes are 0x80 to 0xbf, that is -128 to -65 as signed bytes
+__attribute__((target("sse2"))) uint64_t char_starts_sse2(const char *p) {
+  const __m128i lastContinuation = _mm_set1_epi8(-65);
+  uint64_t m = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+    __m128i hit = _mm_cmpgt_epi8(v, lastContinuation);
+    m |= uint64_t(uint32_t(_mm_movemask_epi8(hit))) << (16 * i);
+  }
+  return m;
+}
+
+__attribute__((target("avx2"))) uint64_t separators_avx2(const char *p) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  uint64_t m = 0;
+  for (int i = 0; i < 2; i++) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * i));
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                  _mm256_cmpeq_epi8(v, newline));
+    m |= uint64_t(uint32_t(_mm256_movemask_epi8(hit))) << (32 * i);
+  }
+  return m;
+}
+
+__attribute__((target("avx2"))) uint64_t char_starts_avx2(const char *p) {
+  const __m256i lastContinuation = _mm256_set1_epi8(-65);
+  uint64_t m = 0;
+  for (int i = 0; i < 2; i++) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * i));
+    __m256i hit = _mm256_cmpgt_epi8(v, lastContinuation);
+    m |= uint64_t(uint32_t(_mm256_movemask_epi8(hit))) << (32 * i);
+  }
+  return m;
+}
+#endif
+
+scan_kernels kernels_for(scan_level level) {
+#ifdef FLEXBPE_X86
+  if (level == kScanAVX2)
+    return {separators_avx2, char_starts_avx2};
+  if (level == kScanSSE2)
+    return {separators_sse2, char_starts_sse2};
+#endif
+  return {separators_scalar, char_starts_scalar};
+}
+} // namespace
+
+scan_level best_scan_level() {
+#ifdef FLEXBPE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return kScanAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return kScanSSE2;
+#endif
+  return kScanScalar;
+}
+
+scan_kernels scan = kernels_for(best_scan_level());
+
+void set_scan_level(scan_level level) {
+  scan = kernels_for(min(level, best_scan_level()));
+}
+
+} // namespace flexBPE
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+
+#include <cstddef>
+
+namespace flexBPE {
+
+using namespace std;
+
+// the byte scans of the text loops work on blocks of 64 bytes. a kernel
+// returns a mask where bit i describes p[i], it is picked at startup from
+// the instruction sets of the cpu.
+enum scan_level { kScanScalar, kScanSSE2, kScanAVX2 };
+
+struct scan_kernels {
+  // bytes that are ' ' or '\n'
+  uint64_t (*separators)(const char *p);
+  // bytes that start a UTF-8 character, i.e. are not continuation bytes
+  uint64_t (*char_starts)(const char *p);
+};
+
+extern scan_kernels scan;
+
+scan_level best_scan_level();
+// for tests and benchmarks, a level the cpu lacks is lowered to the best one
+void set_scan_level(scan_level level);
+
+inline bool is_separator(char c) { return c == ' ' || c == '\n'; }
+inline bool is_char_start(char c) { return (c & 0xc0) != 0x80; }
+
+// calls visit(i) for every i in [0, size) where f[i] is a separator, in order
+template <class F>
+inline void for_each_separator(const char *f, size_t size, F &&visit) {
+  size_t block = 0;
+  for (; block + 64 <= size; block += 64) {
+    for (uint64_t m = scan.separators(f + block); m != 0; m &= m - 1)
+      visit(block + __builtin_ctzll(m));
+  }
+  for (size_t i = block; i < size; i++) {
+    if (is_separator(f[i]))
+      visit(i);
+  }
+}
+
+// same for the bytes that start a character
+template <class F>
+inline void for_each_char_start(const char *f, size_t size, F &&visit) {
+  size_t block = 0;
+  for (; block + 64 <= size; block += 64) {
+    for (uint64_t m = scan.char_starts(f + block); m != 0; m &= m - 1)
+      visit(block + __builtin_ctzll(m));
+  }
+  for (size_t i = block; i < size; i++) {
+    if (is_char_start(f[i]))
+      visit(i);
+  }
+}
+
+} // namespace flexBPE
@@ -0,0 +1,82 @@
+#include "wordCache.h"
+
+namespace flexBPE {
+using namespace std;
+
+word_cache::word_cache(size_t capacity, size_t nShards) : capacity(capacity) {
+  nShards = max<size_t>(1, min(nShards, capacity));
+  for (size_t i = 0; i < nShards; i++) {
+    shards.emplace_back(new shard());
+    auto &s = *shards.back();
+    s.capacity = capacity / nShards + (i < capacity % nShards);
+    s.entries.reserve(s.capacity);
+    s.index.reserve(s.capacity);
+  }
+}
+
+word_cache::shard &word_cache::shard_for(string_view word) {
+  return *shards[hash<string_view>{}(word) % shards.size()];
+}
+
+bool word_cache::lookup(string_view word, string &out) {
+  auto &s = shard_for(word);
+  {
+    lock_guard<mutex> guard(s.lock);
+    auto it = s.index.find(word);
+    if (it != s.index.end()) {
+      auto &e = s.entries[it->second];
+      e.referenced = true;
+      out.append(e.encoded);
+      hits.fetch_add(1, memory_order_relaxed);
+      return true;
+    }
+  }
+  misses.fetch_add(1, memory_order_relaxed);
+  return false;
+}
+
+void word_cache::insert(string_view word, string_view encoded) {
+  auto &s = shard_for(word);
+  lock_guard<mutex> guard(s.lock);
+  if (s.capacity == 0 || s.index.count(word) > 0)
+    return;
+  size_t slot;
+  if (s.entries.size() < s.capacity) {
+    slot = s.entries.size();
+    s.entries.push_back({string(word), string(encoded), false});
+  } else {
+    // give every referenced entry a second chance
+    while (s.entries[s.hand].referenced) {
+      s.entries[s.hand].referenced = false;
+      s.hand = (s.hand + 1) % s.capacity;
+    }
+    slot = s.hand;
+    s.hand = (s.hand + 1) % s.capacity;
+    auto &e = s.entries[slot];
+    s.index.erase(e.word);
+    e.word.assign(word.data(), word.size());
+    e.encoded.assign(encoded.data(), encoded.size());
+    e.referenced = false;
+  }
+  s.index.try_emplace(s.entries[slot].word, slot);
+}
+
+void word_cache::clear() {
+  for (auto &s : shards) {
+    lock_guard<mutex> guard(s->lock);
+    s->index.clear();
+    s->entries.clear();
+    s->hand = 0;
+  }
+}
+
+word_cache_stats word_cache::stats() const {
+  size_t size = 0;
+  for (auto &s : shards) {
+    lock_guard<mutex> guard(s->lock);
+    size += s->entries.size();
+  }
+  return {hits.load(), misses.load(), size, capacity};
+}
+
+} // namespace flexBPE
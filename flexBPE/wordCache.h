@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "flatMap.h"
+
+namespace flexBPE {
+
+using namespace std;
+
+struct word_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  size_t size;
+  size_t capacity;
+};
+
+// bounded map from a word to its encoding that can be shared between
+// threads. it is split into shards with their own lock, every shard evicts
+// with the CLOCK algorithm.
+class word_cache {
+public:
+  explicit word_cache(size_t capacity, size_t nShards = 16);
+
+  // appends the cached encoding of word to out, returns false on a miss
+  bool lookup(string_view word, string &out);
+  void insert(string_view word, string_view encoded);
+  void clear();
+  word_cache_stats stats() const;
+
+private:
+  struct entry {
+    string word;
+    string encoded;
+    bool referenced;
+  };
+  struct shard {
+    mutex lock;
+    // keys are views of entries[i].word, entries never reallocates
+    flat_map<string_view, uint32_t> index;
+    vector<entry> entries;
+    size_t capacity = 0;
+    size_t hand = 0;
+  };
+
+  shard &shard_for(string_view word);
+
+  vector<unique_ptr<shard>> shards;
+  size_t capacity;
+  atomic<uint64_t> hits{0};
+  atomic<uint64_t> misses{0};
+};
+
+} // namespace flexBPE
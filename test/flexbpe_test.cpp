@@ -1,6 +1,11 @@
 #include "flexBPE/flexBPE.h"
 #include "gtest/gtest.h"
 
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+
 using namespace flexBPE;
 
 bool file_exists(const char *fp) {
@@ -22,6 +27,23 @@ void file_test(const char *fp) {
   remove(fp);
 }
 
+// the whole content of a file
+string read_file(const char *fp) {
+  ifstream in(fp, ios::binary);
+  return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+// n distinct words over the letters a to e, 10 words per line
+void write_synthetic_corpus(const char *fp, int n) {
+  ofstream out(fp);
+  for (int i = 0; i < n; i++) {
+    string word;
+    for (int k = i; k > 0; k /= 5)
+      word.push_back("abcde"[k % 5]);
+    out << word << (i % 10 == 9 ? "\n" : " ");
+  }
+}
+
 const char *corpus = "assets/corpus.txt";
 
 TEST(trainerTest, getvocab) {
@@ -44,12 +66,120 @@ TEST(trainerTest, getvocab_twofiles) {
   EXPECT_EQ(trainer.vocab["widest"], 6);
 }
 
+TEST(trainerTest, getvocab_sharded) {
+  // large enough to be split into several shards
+  const char *big_corpus = "assets/corpus_big.txt";
+  {
+    string text = read_file(corpus);
+    ofstream out(big_corpus);
+    for (int i = 0; i < 40000; i++)
+      out << text;
+  }
+  BPETrainer serial = BPETrainer("</w>", 4, "@@", 2, 1);
+  serial.getvocab(big_corpus, "", false);
+  BPETrainer sharded = BPETrainer("</w>", 4, "@@", 2, 4);
+  sharded.getvocab(big_corpus, "", false);
+  EXPECT_EQ(sharded.vocab, serial.vocab);
+  EXPECT_EQ(sharded.vocab["low"], 5 * 40000);
+  EXPECT_EQ(sharded.vocab["widest"], 3 * 40000);
+  remove(big_corpus);
+}
+
 TEST(trainerTest, learncodes) {
   BPETrainer trainer = BPETrainer();
   trainer.learncodes(10, corpus, "", false, true);
   EXPECT_EQ(trainer.codes.size(), 10);
 }
 
+TEST(trainerTest, learncodes_order) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(20, corpus, "", false, false);
+  vector<tps> expected({{"e", "s"},
+                        {"es", "t</w>"},
+                        {"l", "o"},
+                        {"w", "est</w>"},
+                        {"e", "west</w>"},
+                        {"n", "ewest</w>"},
+                        {"lo", "w</w>"},
+                        {"w", "i"},
+                        {"d", "est</w>"},
+                        {"wi", "dest</w>"},
+                        {"w", "e"},
+                        {"lo", "we"},
+                        {"lowe", "r</w>"}});
+  EXPECT_EQ(trainer.codes.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(trainer.codes[expected[i]], i);
+  }
+}
+
+TEST(trainerTest, learncodes_threads) {
+  // enough distinct words to count and merge pairs on several threads
+  const char *synthetic_corpus = "assets/corpus_synthetic.txt";
+  write_synthetic_corpus(synthetic_corpus, 20000);
+  BPETrainer serial = BPETrainer("</w>", 4, "@@", 2, 1);
+  serial.learncodes(100, synthetic_corpus, "", false, false);
+  BPETrainer threaded = BPETrainer("</w>", 4, "@@", 2, 4);
+  threaded.learncodes(100, synthetic_corpus, "", false, false);
+  EXPECT_EQ(threaded.codes.size(), 100);
+  EXPECT_EQ(threaded.codes, serial.codes);
+  remove(synthetic_corpus);
+}
+
+TEST(trainerTest, learncodes_grows_pair_counts) {
+  // the merges of many distinct words keep adding pairs while the counts of
+  // the others are updated. every code must be a most frequent pair when it
+  // is learned, replayed here on plain strings.
+  const char *synthetic_corpus = "assets/corpus_synthetic_grow.txt";
+  write_synthetic_corpus(synthetic_corpus, 5000);
+  BPETrainer trainer = BPETrainer("</w>", 4, "@@", 2, 1);
+  trainer.learncodes(100, synthetic_corpus, "", true, false);
+  vector<pair<uint32_t, tps>> ranked;
+  for (auto &x : trainer.codes)
+    ranked.emplace_back(x.second, x.first);
+  sort(ranked.begin(), ranked.end());
+  ASSERT_EQ(ranked.size(), 100);
+
+  vector<pair<vector<string>, int32_t>> words;
+  for (auto &x : trainer.vocab) {
+    vector<string> symbols;
+    for (char c : x.first)
+      symbols.push_back(string(1, c));
+    symbols.back() += "</w>";
+    words.emplace_back(symbols, x.second);
+  }
+  set<tps> seen;
+  for (auto &code : ranked) {
+    map<tps, int32_t> counts;
+    for (auto &w : words) {
+      for (size_t i = 1; i < w.first.size(); i++)
+        counts[tps(w.first[i - 1], w.first[i])] += w.second;
+    }
+    for (auto &c : counts)
+      seen.insert(c.first);
+    int32_t best = 0;
+    for (auto &c : counts)
+      best = max(best, c.second);
+    EXPECT_EQ(counts[code.second], best) << code.first;
+    for (auto &w : words) {
+      vector<string> merged;
+      for (size_t i = 0; i < w.first.size(); i++) {
+        if (i + 1 < w.first.size() && w.first[i] == code.second.first &&
+            w.first[i + 1] == code.second.second) {
+          merged.push_back(w.first[i] + w.first[i + 1]);
+          i++;
+        } else {
+          merged.push_back(w.first[i]);
+        }
+      }
+      w.first = merged;
+    }
+  }
+  // far more pairs than the first count found
+  EXPECT_GT(seen.size(), 1000);
+  remove(synthetic_corpus);
+}
+
 TEST(trainerTest, learncodes_twofiles) {
   BPETrainer trainer = BPETrainer();
   trainer.learncodes(10, corpus, corpus, false, true);
@@ -63,6 +193,53 @@ TEST(trainerTest, learncodes_shortstop) {
   EXPECT_LT(trainer.codes.size(), num_merges);
 }
 
+TEST(trainerTest, learncodes_counts) {
+  const char *shard1 = "assets/vocab_shard1.txt";
+  const char *shard2 = "assets/vocab_shard2.txt";
+  const char *merged = "assets/vocab_merged.txt";
+  {
+    ofstream out1(shard1), out2(shard2);
+    out1 << "newest 6\nlow 3\nwidest 1\n";
+    out2 << "low 2\nlower 2\nwidest 2\n";
+  }
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", true, false);
+  BPETrainer counted = BPETrainer();
+  counted.learncodes_counts(10, {shard1, shard2}, true, false);
+  EXPECT_EQ(counted.vocab, trainer.vocab);
+  EXPECT_EQ(counted.codes.size(), 10);
+
+  // merged in the order of getvocab, by count then by word
+  counted.mergevocab(merged, {shard1, shard2});
+  EXPECT_EQ(read_file(merged), "newest 6\nlow 5\nwidest 3\nlower 2\n");
+  BPETrainer fromMerged = BPETrainer();
+  fromMerged.learncodes_counts(10, {merged}, true, false);
+  EXPECT_EQ(fromMerged.vocab, trainer.vocab);
+  file_test(shard1);
+  file_test(shard2);
+  file_test(merged);
+}
+
+TEST(trainerTest, learncodes_output_shortstop) {
+  // the codes written to stdout can be read back, also when fewer merges
+  // than asked for can be made
+  const char *codes_file = "assets/codes_shortstop.txt";
+  BPETrainer trainer = BPETrainer();
+  testing::internal::CaptureStdout();
+  trainer.learncodes(1000, corpus, "", false, true);
+  string codes = testing::internal::GetCapturedStdout();
+  EXPECT_LT(trainer.codes.size(), 1000);
+  {
+    ofstream out(codes_file);
+    out << codes;
+  }
+  BPEInference inference = BPEInference(codes_file, "");
+  EXPECT_EQ(inference.codes, trainer.codes);
+  string sentence("low lower newest widest");
+  EXPECT_EQ(inference.apply(sentence), trainer.apply(sentence));
+  file_test(codes_file);
+}
+
 TEST(trainerTest, save_vocab) {
   const char *vocab_file = "vocab-save_vocab.txt";
   BPETrainer trainer = BPETrainer();
@@ -87,6 +264,21 @@ TEST(trainerTest, save_trained) {
   file_test("merges.txt");
 }
 
+TEST(trainerTest, read_trained) {
+  // codes and vocab read into a trainer are used by the next apply
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", true, false);
+  trainer.save_trained(".");
+  string sentence("lower abc widest");
+  BPETrainer reader = BPETrainer();
+  reader.readCodes("merges.txt", reader.codes, reader.reversed_codes);
+  EXPECT_EQ(reader.apply(sentence), "lo@@ w@@ e@@ r a@@ b@@ c widest");
+  reader.readVocab("vocab.txt", reader.vocab);
+  EXPECT_EQ(reader.apply(sentence), trainer.apply(sentence));
+  file_test("vocab.txt");
+  file_test("merges.txt");
+}
+
 TEST(trainerTest, applybpe_with_vocab) {
   // output: "low low low low low l@@ o@@ w@@ e@@ r l@@ o@@ w@@ e@@ r newest
   // newest newest newest newest newest widest widest widest"
@@ -107,6 +299,47 @@ TEST(trainerTest, applybpe_without_vocab) {
   file_test(output_file);
 }
 
+TEST(trainerTest, applybpe_chunked) {
+  // large enough to be encoded in several parts
+  const char *big_corpus = "assets/corpus_big_chunked.txt";
+  {
+    string text = read_file(corpus);
+    ofstream out(big_corpus);
+    for (int i = 0; i < 40000; i++)
+      out << text;
+    // a last word without separator is dropped by both modes
+    out << "lowest";
+  }
+  const char *mapped_file = "assets/corpus_encoded_mapped.txt";
+  const char *chunked_file = "assets/corpus_encoded_chunked.txt";
+  BPETrainer trainer = BPETrainer("</w>", 4, "@@", 2, 3);
+  trainer.learncodes(10, corpus, "", true, false);
+  trainer.applybpe(mapped_file, big_corpus);
+  trainer.applybpe_chunked(chunked_file, big_corpus);
+  EXPECT_EQ(read_file(chunked_file), read_file(mapped_file));
+  file_test(mapped_file);
+  file_test(chunked_file);
+  remove(big_corpus);
+}
+
+TEST(trainerTest, applybpe_threads) {
+  // many distinct words, so the threads share the segmentation
+  const char *synthetic_corpus = "assets/corpus_synthetic_apply.txt";
+  write_synthetic_corpus(synthetic_corpus, 20000);
+  const char *serial_file = "assets/corpus_encoded_serial.txt";
+  const char *threaded_file = "assets/corpus_encoded_threaded.txt";
+  BPETrainer serial = BPETrainer("</w>", 4, "@@", 2, 1);
+  serial.learncodes(100, synthetic_corpus, "", false, false);
+  serial.applybpe(serial_file, synthetic_corpus);
+  BPETrainer threaded = BPETrainer("</w>", 4, "@@", 2, 4);
+  threaded.learncodes(100, synthetic_corpus, "", false, false);
+  threaded.applybpe(threaded_file, synthetic_corpus);
+  EXPECT_EQ(read_file(threaded_file), read_file(serial_file));
+  file_test(serial_file);
+  file_test(threaded_file);
+  remove(synthetic_corpus);
+}
+
 TEST(trainerTest, trainer_constructor_args) {
   BPETrainer trainer = BPETrainer("§§", 4, "§", 2, 2);
   trainer.learncodes(10, corpus, "", false, true);
@@ -157,6 +390,398 @@ TEST(inferenceTest, applybpe_novocab) {
   file_test("merges.txt");
 }
 
+TEST(inferenceTest, apply_unknown_chars) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", false, false);
+  string input("lowü ü wider  newest");
+  EXPECT_EQ(trainer.apply(input), "lo@@ w@@ ü ü wi@@ d@@ e@@ r newest");
+}
+
+TEST(inferenceTest, apply_long_word) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(20, corpus, "", false, false);
+  string input, expected;
+  for (int i = 0; i < 19; i++) {
+    input += "lower";
+    expected += "lowe@@ r@@ ";
+  }
+  input += "lower";
+  expected += "lower";
+  EXPECT_EQ(trainer.apply(input), expected);
+}
+
+TEST(inferenceTest, apply_cached) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", true, false);
+  trainer.save_trained(".");
+  BPEInference inference =
+      BPEInference("merges.txt", "", "</w>", 4, "@@", 2, 2, 10000000, 3);
+  vector<string> sentences({"wider newer lowest", "wider lowest lower",
+                            "newest wider", "wider newer lowest"});
+  vector<string> expected(
+      {"wi@@ d@@ e@@ r n@@ e@@ w@@ e@@ r lo@@ west",
+       "wi@@ d@@ e@@ r lo@@ west lo@@ w@@ e@@ r", "newest wi@@ d@@ e@@ r",
+       "wi@@ d@@ e@@ r n@@ e@@ w@@ e@@ r lo@@ west"});
+  // several threads share the cache, which holds fewer words than used
+  vector<thread> threads;
+  vector<vector<string>> results(4);
+  for (size_t t = 0; t < results.size(); t++) {
+    threads.emplace_back([&](size_t i) {
+      for (int n = 0; n < 100; n++)
+        results[i] = inference.apply(sentences);
+    }, t);
+  }
+  for (size_t t = 0; t < results.size(); t++) {
+    threads[t].join();
+    EXPECT_EQ(results[t], expected);
+  }
+  auto stats = inference.cache_stats();
+  EXPECT_EQ(stats.capacity, 3);
+  EXPECT_LE(stats.size, 3);
+  EXPECT_GT(stats.hits, 0);
+  EXPECT_EQ(stats.hits + stats.misses, 4 * 100 * 11);
+  file_test("vocab.txt");
+  file_test("merges.txt");
+}
+
+TEST(inferenceTest, applybpe_stream_batches) {
+  BPETrainer trainer = BPETrainer("</w>", 4, "@@", 2, 3);
+  trainer.learncodes(10, corpus, "", false, false);
+  vector<string> lines({"wider newer lowest", "", "lower  newest", "low",
+                        "widest wider", "newest lowest lower"});
+  string input, expected;
+  for (auto &line : lines) {
+    input += line + "\n";
+    expected += trainer.apply(line) + "\n";
+  }
+  // the last line does not need a newline
+  input.pop_back();
+  // 0 is taken as 1 line per batch
+  for (size_t batchLines : {0, 1, 2, 4, 100}) {
+    istringstream in(input);
+    ostringstream out;
+    trainer.applybpe_stream(in, out, batchLines);
+    EXPECT_EQ(out.str(), expected);
+  }
+  istringstream encoded(expected);
+  ostringstream decoded;
+  trainer.decode_stream(encoded, decoded, 0);
+  EXPECT_EQ(decoded.str(), "wider newer lowest\n\nlower newest\nlow\n"
+                           "widest wider\nnewest lowest lower\n");
+}
+
+TEST(inferenceTest, compiled_model) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", true, false);
+  trainer.save_trained(".");
+  vector<string> test_words({"wider", "newer", "lowest"});
+  for (const char *vocab_file : {"vocab.txt", ""}) {
+    BPEInference inference = BPEInference("merges.txt", vocab_file);
+    inference.save_compiled("model.bin");
+    BPEInference mapped = BPEInference("model.bin", "");
+    EXPECT_EQ(mapped.codes.size(), 0);
+    EXPECT_EQ(mapped.apply(test_words), inference.apply(test_words));
+    file_test("model.bin");
+  }
+  file_test("vocab.txt");
+  file_test("merges.txt");
+}
+
+TEST(inferenceTest, apply_batch) {
+  BPETrainer inference = BPETrainer();
+  inference.learncodes(10, corpus, "", false, false);
+  vector<string> sentences({"low lower  newest", "", " widest wider "});
+  string text = "low lower  newest|| widest wider ";
+  vector<string_view> views;
+  for (size_t start = 0; start <= text.size();) {
+    size_t end = min(text.find('|', start), text.size());
+    views.push_back(string_view(text).substr(start, end - start));
+    start = end + 1;
+  }
+  ASSERT_EQ(views.size(), sentences.size());
+  encoded_batch batch;
+  // the second call reuses the buffers of the first
+  for (int i = 0; i < 2; i++) {
+    inference.apply(views, batch);
+    ASSERT_EQ(batch.size(), sentences.size());
+    for (size_t j = 0; j < sentences.size(); j++)
+      EXPECT_EQ(batch[j], inference.apply(sentences[j]));
+  }
+  EXPECT_EQ(batch[0], "low lo@@ w@@ e@@ r newest");
+  EXPECT_EQ(batch[1], "");
+}
+
+TEST(inferenceTest, apply_ids) {
+  // all the codes, so that every character has an id
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(100, corpus, "", true, false);
+  trainer.save_trained(".");
+  string sentence("low lower newest widest wider lowest");
+  for (const char *vocab_file : {"vocab.txt", ""}) {
+    BPEInference inference = BPEInference("merges.txt", vocab_file);
+    vector<uint32_t> ids = inference.apply_ids(sentence);
+    string text;
+    for (auto id : ids) {
+      EXPECT_LT(id, inference.unk_id());
+      text += inference.token(id) + " ";
+    }
+    text.pop_back();
+    EXPECT_EQ(text, inference.apply(sentence));
+    // a character without codes, and one that ends the word
+    vector<uint32_t> inner = inference.apply_ids("lozw");
+    EXPECT_EQ(count(inner.begin(), inner.end(), inference.unk_id()), 1);
+    EXPECT_EQ(inference.apply_ids("lowz").back(), inference.unk_final_id());
+
+    vector<string> sentences({sentence, "", "newest"});
+    vector<uint32_t> flat;
+    vector<size_t> offsets;
+    inference.apply_ids(sentences, flat, offsets);
+    ASSERT_EQ(offsets.size(), 4);
+    EXPECT_EQ(vector<uint32_t>(flat.begin(), flat.begin() + offsets[1]), ids);
+    EXPECT_EQ(offsets[1], offsets[2]);
+    EXPECT_EQ(offsets[3], flat.size());
+  }
+  file_test("vocab.txt");
+  file_test("merges.txt");
+}
+
+TEST(inferenceTest, apply_ids_stable) {
+  // the ids only depend on the codes, not on the order they are added in
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(100, corpus, "", false, false);
+  vector<pair<tps, uint32_t>> ranked(trainer.codes.begin(),
+                                     trainer.codes.end());
+  BPETrainer forward = BPETrainer(), backward = BPETrainer();
+  for (size_t i = 0; i < ranked.size(); i++) {
+    forward.codes.insert(ranked[i]);
+    backward.codes.insert(ranked[ranked.size() - 1 - i]);
+  }
+  forward.compile();
+  backward.compile();
+  string sentence("low lower newest widest wider lowest");
+  EXPECT_EQ(forward.apply_ids(sentence), trainer.apply_ids(sentence));
+  EXPECT_EQ(backward.apply_ids(sentence), trainer.apply_ids(sentence));
+  ASSERT_EQ(backward.n_ids(), trainer.n_ids());
+  for (uint32_t id = 0; id < trainer.n_ids(); id++)
+    EXPECT_EQ(backward.token(id), trainer.token(id));
+}
+
+TEST(inferenceTest, applybpe_ids) {
+  const char *text_file = "assets/corpus_encoded_text.txt";
+  const char *ids_file = "assets/corpus_encoded_ids.bin";
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(100, corpus, "", true, false);
+  trainer.applybpe(text_file, corpus);
+  trainer.applybpe_ids(ids_file, corpus);
+
+  string data = read_file(ids_file);
+  ids_header h;
+  memcpy(&h, data.data(), sizeof(h));
+  EXPECT_EQ(string(h.magic), "flexIDS");
+  EXPECT_EQ(h.idBytes, 2);
+  vector<uint64_t> offsets(h.nLines + 1);
+  memcpy(offsets.data(), data.data() + h.offsetsAt,
+         offsets.size() * sizeof(uint64_t));
+  EXPECT_EQ(offsets.back(), h.nIds);
+
+  ifstream text_in(text_file);
+  string line;
+  for (size_t i = 0; i < h.nLines; i++) {
+    ASSERT_TRUE(getline(text_in, line));
+    string decoded;
+    for (uint64_t j = offsets[i]; j < offsets[i + 1]; j++) {
+      uint16_t id;
+      memcpy(&id, data.data() + h.idsAt + j * 2, 2);
+      decoded += trainer.token(id) + " ";
+    }
+    if (!decoded.empty())
+      decoded.pop_back();
+    EXPECT_EQ(decoded, line);
+  }
+  EXPECT_FALSE(getline(text_in, line));
+  file_test(text_file);
+  file_test(ids_file);
+}
+
+TEST(inferenceTest, decode) {
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", false, false);
+  string sentence("low lower newest widest wider lowest");
+  string encoded = trainer.apply(sentence);
+  trainer.decode(encoded);
+  EXPECT_EQ(encoded, sentence);
+  // a delimiter that ends the text is removed, others are kept
+  string text("lo@@ w@@ e@@r a@@@@ b@@");
+  trainer.decode(text);
+  EXPECT_EQ(text, "lowe@@r a@@b");
+
+  vector<string> sentences({"lo@@ w@@ e@@ r newest", "", "wi@@ d@@ est"});
+  vector<string_view> views(sentences.begin(), sentences.end());
+  encoded_batch batch;
+  trainer.decode(views, batch);
+  ASSERT_EQ(batch.size(), 3);
+  EXPECT_EQ(batch[0], "lower newest");
+  EXPECT_EQ(batch[1], "");
+  EXPECT_EQ(batch[2], "widest");
+
+  trainer.learncodes(100, corpus, "", false, false);
+  vector<uint32_t> ids = trainer.apply_ids(sentence);
+  EXPECT_EQ(trainer.decode_ids(ids), sentence);
+  // unknown characters are dropped, the words they end stay apart
+  EXPECT_EQ(trainer.decode_ids(trainer.apply_ids("lowQ lozw Q lower")),
+            "low low  lower");
+}
+
+TEST(inferenceTest, decodebpe) {
+  const char *text_file = "assets/corpus_encoded_decode.txt";
+  const char *ids_file = "assets/corpus_encoded_decode.bin";
+  const char *decoded_file = "assets/corpus_decoded.txt";
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(100, corpus, "", true, false);
+  string original = read_file(corpus);
+
+  trainer.applybpe(text_file, corpus);
+  trainer.applybpe_ids(ids_file, corpus);
+  for (const char *input : {text_file, ids_file}) {
+    trainer.decodebpe(decoded_file, input);
+    EXPECT_EQ(read_file(decoded_file), original);
+  }
+
+  ifstream text_in(text_file);
+  stringstream out;
+  trainer.decode_stream(text_in, out, 1);
+  EXPECT_EQ(out.str(), original);
+  file_test(text_file);
+  file_test(ids_file);
+  file_test(decoded_file);
+}
+
+TEST(trainerTest, stats) {
+  const char *stats_file = "assets/stats.json";
+  const char *trace_file = "assets/trace.json";
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(10, corpus, "", false, false);
+  // nothing is recorded until stats are enabled
+  EXPECT_EQ(trainer.stats().wordsRead, 0);
+  EXPECT_EQ(trainer.stats().seconds[kPhaseMerge], 0);
+  EXPECT_GT(trainer.stats().peakRssBytes, 0);
+
+  trainer.enable_stats(true);
+  trainer.learncodes(10, corpus, "", false, false);
+  trainer.set_cache_capacity(16);
+  string sentence("lower newest lower");
+  trainer.apply(sentence);
+  bpe_stats stats = trainer.stats();
+  EXPECT_EQ(stats.wordsRead, 16);
+  EXPECT_EQ(stats.uniqueWords, 4);
+  EXPECT_EQ(stats.merges, 10);
+  EXPECT_GT(stats.livePairs, 0);
+  EXPECT_GT(stats.postingBytes, 0);
+  EXPECT_EQ(stats.wordsSegmented, 3);
+  EXPECT_EQ(stats.cacheHits, 1);
+  EXPECT_EQ(stats.cacheMisses, 2);
+  for (auto phase : {kPhaseRead, kPhaseTokenize, kPhaseCount, kPhaseMerge,
+                     kPhaseSegment})
+    EXPECT_GT(stats.seconds[phase], 0) << phase_name(phase);
+  EXPECT_NE(stats.to_json().find("\"merges\": 10"), string::npos);
+
+  trainer.save_stats(stats_file);
+  trainer.save_trace(trace_file);
+  string trace = read_file(trace_file);
+  EXPECT_NE(trace.find("\"name\": \"merge\", \"ph\": \"X\""), string::npos);
+  file_test(stats_file);
+  file_test(trace_file);
+
+  trainer.disable_stats();
+  EXPECT_EQ(trainer.stats().wordsRead, 0);
+}
+
+TEST(scanTest, kernels_match_scalar) {
+  string text;
+  for (int i = 0; i < 1000; i++) {
+    text += (i % 7 == 0) ? "\xce\xb2" : string(1, 'a' + i % 26);
+    if (i % 5 == 0)
+      text += (i % 35 == 0) ? "\n" : " ";
+  }
+  vector<vector<size_t>> separators, starts;
+  for (auto level : {kScanScalar, kScanSSE2, kScanAVX2}) {
+    set_scan_level(level);
+    // every length, so that the scalar tail is covered too
+    for (size_t size : {text.size(), text.size() - 1, size_t(63), size_t(0)}) {
+      separators.emplace_back();
+      for_each_separator(text.data(), size,
+                         [&](size_t i) { separators.back().push_back(i); });
+      starts.emplace_back();
+      for_each_char_start(text.data(), size,
+                          [&](size_t i) { starts.back().push_back(i); });
+    }
+  }
+  set_scan_level(best_scan_level());
+  for (size_t i = 4; i < separators.size(); i++) {
+    EXPECT_EQ(separators[i], separators[i % 4]);
+    EXPECT_EQ(starts[i], starts[i % 4]);
+  }
+  EXPECT_EQ(separators[0].size(), 200);
+  EXPECT_EQ(starts[0].size(), 1200);
+}
+
+TEST(flatMapTest, matches_unordered_map) {
+  flat_map<tp, int32_t> flat;
+  unordered_map<tp, int32_t, pair_hash> reference;
+  mt19937 rng(3);
+  for (int i = 0; i < 100000; i++) {
+    tp key(rng() % 64, rng() % 64);
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(flat.erase(key), reference.erase(key) > 0);
+    } else {
+      flat[key] += i;
+      reference[key] += i;
+    }
+  }
+  ASSERT_EQ(flat.size(), reference.size());
+  for (auto &x : reference) {
+    auto it = flat.find(x.first);
+    ASSERT_NE(it, flat.end());
+    EXPECT_EQ(it->second, x.second);
+  }
+  size_t n = 0;
+  for (auto &x : flat)
+    n += reference.count(x.first);
+  EXPECT_EQ(n, reference.size());
+}
+
+TEST(flatMapTest, lookup_does_not_grow) {
+  // 12 keys fill 16 slots up to the load limit, the next insert grows
+  flat_map<uint64_t, int32_t> flat;
+  for (uint64_t k = 0; k < 12; k++)
+    flat[k] = int32_t(k);
+  int32_t *first = &flat.find(0)->second;
+  for (uint64_t k = 0; k < 12; k++)
+    EXPECT_EQ(flat[k], int32_t(k));
+  EXPECT_EQ(&flat[0], first);
+  EXPECT_FALSE(flat.try_emplace(5, 0).second);
+  EXPECT_EQ(&flat[0], first);
+  EXPECT_TRUE(flat.try_emplace(12, 12).second);
+  EXPECT_EQ(flat.size(), 13);
+  for (uint64_t k = 0; k < 13; k++)
+    EXPECT_EQ(flat[k], int32_t(k));
+}
+
+TEST(postingListTest, add_and_compact) {
+  posting_list list;
+  list.add(3);
+  list.add(3);
+  list.add(1);
+  EXPECT_EQ(list.words, vector<uint32_t>({3, 1}));
+  for (uint32_t wi = 20; wi > 0; wi--)
+    list.add(wi % 10);
+  // compacted once it reached 16 words, the later ones are appended
+  EXPECT_EQ(list.compacted, 10);
+  EXPECT_EQ(list.words.size(), 16);
+  list.compact();
+  EXPECT_EQ(list.words, vector<uint32_t>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
 TEST(trainerDeathTest, input_does_not_exist) {
   string nonexistent_vocab_file("assets/nocorpus.txt");
   string nonexistent_codes_file("assets/nocorpus.txt");
@@ -176,6 +801,58 @@ TEST(trainerDeathTest, input_does_not_exist) {
       "");
 }
 
+TEST(trainerDeathTest, invalid_counts) {
+  const char *counts = "assets/counts_invalid.txt";
+  {
+    ofstream out(counts);
+    out << "low 5\nlower\n";
+  }
+  ASSERT_DEATH(
+      {
+        BPETrainer trainer = BPETrainer();
+        trainer.learncodes_counts(10, {counts});
+      },
+      "Invalid line");
+  // a count that would wrap a uint64
+  {
+    ofstream out(counts);
+    out << "low 5\nlower 184467440737095516170\n";
+  }
+  ASSERT_DEATH(
+      {
+        BPETrainer trainer = BPETrainer();
+        trainer.mergevocab("assets/counts_merged.txt", {counts});
+      },
+      "Count above .* lower 184467440737095516170");
+  remove(counts);
+}
+
+TEST(trainerDeathTest, corrupt_ids) {
+  const char *ids_file = "assets/corpus_corrupt_ids.bin";
+  const char *decoded_file = "assets/corpus_corrupt_decoded.txt";
+  BPETrainer trainer = BPETrainer();
+  trainer.learncodes(100, corpus, "", false, false);
+  trainer.applybpe_ids(ids_file, corpus);
+  string data = read_file(ids_file);
+  ids_header h;
+  memcpy(&h, data.data(), sizeof(h));
+
+  // a truncated file, and a line that ends past the ids
+  string truncated = data.substr(0, data.size() - 1);
+  string past = data;
+  uint64_t end = h.nIds + 1;
+  memcpy(&past[h.offsetsAt + h.nLines * sizeof(uint64_t)], &end, sizeof(end));
+  for (const string &corrupt : {truncated, past}) {
+    {
+      ofstream out(ids_file, ios::binary);
+      out << corrupt;
+    }
+    ASSERT_DEATH(trainer.decodebpe(decoded_file, ids_file), "corrupt");
+  }
+  remove(ids_file);
+  remove(decoded_file);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();